@@ -5,7 +5,8 @@
  * Copyright 2009, Boris Hajduk <boris@hajduk.org>
  * Copyright 2019, Olimex Ltd <support@olimex.com>
  *
- * ch340.c implements a serial port driver for the Winchiphead CH340.
+ * ch340.c implements a serial port driver for the Winchiphead CH340, and
+ * for the CH341 in its serial mode, which speaks the same protocol.
  *
  * The CH340 device can be used to implement an RS232 asynchronous
  * serial port, an IEEE-1284 parallel printer port or a memory-like
@@ -14,17 +15,91 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/ctype.h>
 #include <linux/tty.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
 #include <linux/usb.h>
 #include <linux/usb/serial.h>
 #include <linux/serial.h>
+#include <linux/version.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/pm_runtime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/pps_kernel.h>
 #include <asm/unaligned.h>
 
+#include "ch340_baud.h"
+
+#define CREATE_TRACE_POINTS
+#include "ch340_trace.h"
+
 #define DEFAULT_BAUD_RATE 9600
 #define DEFAULT_TIMEOUT   1000
 
+/* size of the per-port buffer used for control reads */
+#define CH340_CTRL_BUF_SIZE 8
+/* control requests that can be queued per port */
+#define CH340_CTRL_QUEUE_LEN 16
+/* requests that can be waited on together */
+#define CH340_CTRL_BATCH_LEN 8
+
+/* bulk-in read ring and bulk-out write queue limits */
+#define CH340_RX_URBS_MAX     16
+#define CH340_RX_BUF_SIZE_MAX 16384
+#define CH340_TX_URBS_MAX     16
+#define CH340_TX_BUF_SIZE_MAX 16384
+
+/* limits of a modem control sequence written through sysfs */
+#define CH340_MCR_SEQ_MAX          32
+#define CH340_MCR_SEQ_DELAY_MAX_US 1000000
+
+/* limit of the RS485 RTS delays, as in the serial core */
+#define CH340_RS485_DELAY_MAX_MS 100
+
+/*
+ * RS485 direction control: RTS is switched to its send level before the
+ * first write urb goes out and back once the line has drained.
+ */
+enum ch340_rs485_state {
+	CH340_RS485_IDLE,
+	CH340_RS485_ASSERTING,	/* work is switching RTS to the send level */
+	CH340_RS485_SENDING,
+	CH340_RS485_DRAINING,	/* timer runs until the release is due */
+	CH340_RS485_RELEASING,	/* work is switching RTS back */
+};
+
+/* private flags */
+#define CH340_RX_THROTTLED 0
+#define CH340_TX_BUSY      1
+#define CH340_INT_DEGRADED 2
+
+/*
+ * Interrupt urb errors are retried after an exponential backoff; after
+ * CH340_INT_MAX_ERRORS in a row the port is marked degraded and the urb
+ * is left stopped until the port is reopened or resumed.
+ */
+#define CH340_INT_BACKOFF_MIN_MS 4
+#define CH340_INT_BACKOFF_MAX_MS 1000
+#define CH340_INT_MAX_ERRORS     10
+
+/*
+ * Chip variant quirks, from the version and from probing. Some chips lack
+ * the break register, which also marks the ones that need the lower base
+ * clock below the highest prescaler; at least one version 0x27 device has
+ * the sense of the packet buffering bit inverted.
+ */
+#define CH340_QUIRK_LIMITED_PRESCALER BIT(0)
+#define CH340_QUIRK_NO_BREAK          BIT(1)
+#define CH340_QUIRK_BUFFERING_INVERTED BIT(2)
+
 /* flags for IO-Bits */
 #define CH340_BIT_RTS (1 << 6)
 #define CH340_BIT_DTR (1 << 5)
@@ -49,12 +124,31 @@
 #define CH340_BIT_DCD 0x08
 #define CH340_BITS_MODEM_STAT 0x0f /* all bits */
 
-/*******************************/
-/* baudrate calculation factor */
-/*******************************/
-// #define CH340_BAUDBASE_FACTOR 1532620800
-#define CH340_BAUDBASE_FACTOR 6000000
-#define CH340_BAUDBASE_DIVMAX 3
+/* line errors since the last event, inverted in the fourth irq byte */
+#define CH340_LSR_OVERRUN 0x02
+#define CH340_LSR_PARITY  0x04
+#define CH340_LSR_FRAME   0x08
+#define CH340_LSR_ERRORS  (CH340_LSR_OVERRUN | CH340_LSR_PARITY | \
+			   CH340_LSR_FRAME)
+
+/*
+ * Bulk-in aggregation: in latency mode the chip sends every byte as soon
+ * as it arrives, in throughput mode it may fill endpoint-size packets
+ * first, and auto mode picks throughput from CH340_RX_MODE_AUTO_BAUD up.
+ */
+enum ch340_rx_mode {
+	CH340_RX_MODE_AUTO,
+	CH340_RX_MODE_LATENCY,
+	CH340_RX_MODE_THROUGHPUT,
+};
+
+static const char * const ch340_rx_mode_names[] = {
+	[CH340_RX_MODE_AUTO]		= "auto",
+	[CH340_RX_MODE_LATENCY]		= "latency",
+	[CH340_RX_MODE_THROUGHPUT]	= "throughput",
+};
+
+#define CH340_RX_MODE_AUTO_BAUD 921600
 
 /* Break support - the information used to implement this was gleaned from
  * the Net/FreeBSD uchcom.c driver by Takanori Watanabe.  Domo arigato.
@@ -68,7 +162,16 @@
 
 #define CH340_REG_BREAK        0x05
 #define CH340_REG_LCR          0x18
+#define CH340_REG_FLOW         0x27
 #define CH340_NBREAK_BITS      0x01
+#define CH340_NUM_REGS         256
+
+/* break and LCR registers, read and written as a pair */
+#define CH340_BREAK_REG        (((u16)CH340_REG_LCR << 8) | CH340_REG_BREAK)
+
+/* automatic RTS/CTS flow control, as set by the vendor driver */
+#define CH340_FLOW_REG         (((u16)CH340_REG_FLOW << 8) | CH340_REG_FLOW)
+#define CH340_FLOW_RTSCTS      0x0101
 
 #define CH340_LCR_ENABLE_RX    0x80
 #define CH340_LCR_ENABLE_TX    0x40
@@ -81,283 +184,3475 @@
 #define CH340_LCR_CS6          0x01
 #define CH340_LCR_CS5          0x00
 
+/*
+ * What each chip in the id table can do, passed through driver_info.
+ * The chip only accepts a bulk-out packet once it has room for it, so
+ * when a write urb completes, at most fifo_size bytes are still waiting
+ * to go out on the line. Versions up to buffering_inverted_max have the
+ * sense of the buffering bit inverted; the other quirks are found at probe.
+ */
+struct ch340_chip {
+	const char *name;
+	unsigned int max_baud;
+	unsigned int fifo_size;
+	u8 buffering_inverted_max;
+};
+
+static const struct ch340_chip ch340_chip_ch340 = {
+	.name			= "CH340",
+	.max_baud		= CH340_BAUD_MAX,
+	.fifo_size		= 32,
+	.buffering_inverted_max	= 0x27,
+};
+
+static const struct ch340_chip ch340_chip_ch341 = {
+	.name			= "CH341",
+	.max_baud		= 2000000,
+	.fifo_size		= 32,
+};
+
 static const struct usb_device_id id_table[] = {
-	{ USB_DEVICE(0x1a86, 0x7523) },
+	{ USB_DEVICE(0x1a86, 0x7523),
+	  .driver_info = (kernel_ulong_t)&ch340_chip_ch340 },
+	{ USB_DEVICE(0x1a86, 0x7522),
+	  .driver_info = (kernel_ulong_t)&ch340_chip_ch340 },
+	{ USB_DEVICE(0x1a86, 0x5523),
+	  .driver_info = (kernel_ulong_t)&ch340_chip_ch341 },
+	{ USB_DEVICE(0x4348, 0x5523),
+	  .driver_info = (kernel_ulong_t)&ch340_chip_ch341 },
 	{ },
 };
 MODULE_DEVICE_TABLE(usb, id_table);
 
+static unsigned int rx_urbs = 4;
+module_param(rx_urbs, uint, 0644);
+MODULE_PARM_DESC(rx_urbs, "Number of bulk-in URBs kept in flight (1-16)");
+
+static unsigned int rx_buf_size = 512;
+module_param(rx_buf_size, uint, 0644);
+MODULE_PARM_DESC(rx_buf_size, "Size of each bulk-in URB buffer in bytes");
+
+static unsigned int tx_urbs = 4;
+module_param(tx_urbs, uint, 0644);
+MODULE_PARM_DESC(tx_urbs, "Number of bulk-out URBs allowed in flight (1-16)");
+
+static unsigned int tx_buf_size = 512;
+module_param(tx_buf_size, uint, 0644);
+MODULE_PARM_DESC(tx_buf_size, "Size of each bulk-out URB buffer in bytes");
+
+static bool break_verify;
+module_param(break_verify, bool, 0644);
+MODULE_PARM_DESC(break_verify, "Read back the break register after each change");
+
+static unsigned int baud_tolerance;
+module_param(baud_tolerance, uint, 0644);
+MODULE_PARM_DESC(baud_tolerance, "Reject baud rates the chip misses by more than this many ppm (0 = accept any)");
+
+static int autosuspend_delay = -1;
+module_param(autosuspend_delay, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay, "Autosuspend idle ports after this many ms (-1 = leave to the USB core)");
+
+static bool pps;
+module_param(pps, bool, 0644);
+MODULE_PARM_DESC(pps, "Register a PPS source for DCD edges on new ports");
+
+static bool int_park;
+module_param(int_park, bool, 0644);
+MODULE_PARM_DESC(int_park, "Stop the interrupt urb while nothing needs modem status");
+
+static bool histograms;
+module_param(histograms, bool, 0644);
+MODULE_PARM_DESC(histograms, "Record RX delivery and control latency histograms in debugfs");
+
+static struct dentry *ch340_debugfs_root;
+
+struct ch340_ctrl_wait {
+	struct completion done;
+	void *data;	/* destination of a control read */
+	int status;
+};
+
+/* control requests queued back to back and waited on together */
+struct ch340_ctrl_batch {
+	struct ch340_ctrl_wait waits[CH340_CTRL_BATCH_LEN];
+	unsigned int count;
+	int err;
+};
+
+struct ch340_ctrl_req {
+	u8 request;
+	u16 value;
+	u16 index;
+	u16 size;	/* bytes to read, zero for writes */
+	struct ch340_ctrl_wait *wait;	/* NULL if nobody waits */
+	bool cancelled;	/* dropped by a timed out waiter, never sent */
+};
+
+/* urb completion statuses counted separately in the statistics */
+enum {
+	CH340_ERR_EPROTO,
+	CH340_ERR_EILSEQ,
+	CH340_ERR_ETIME,
+	CH340_ERR_EPIPE,
+	CH340_ERR_EOVERFLOW,
+	CH340_ERR_STOPPED,
+	CH340_ERR_OTHER,
+	CH340_ERR_MAX
+};
+
+static const char * const ch340_err_names[CH340_ERR_MAX] = {
+	[CH340_ERR_EPROTO]	= "eproto",
+	[CH340_ERR_EILSEQ]	= "eilseq",
+	[CH340_ERR_ETIME]	= "etime",
+	[CH340_ERR_EPIPE]	= "epipe",
+	[CH340_ERR_EOVERFLOW]	= "eoverflow",
+	[CH340_ERR_STOPPED]	= "stopped",
+	[CH340_ERR_OTHER]	= "other",
+};
+
+/* vendor requests counted separately in the statistics */
+enum {
+	CH340_CTRL_READ_VERSION,
+	CH340_CTRL_WRITE_REG,
+	CH340_CTRL_READ_REG,
+	CH340_CTRL_SERIAL_INIT,
+	CH340_CTRL_MODEM_CTRL,
+	CH340_CTRL_MAX
+};
+
+static const char * const ch340_ctrl_names[CH340_CTRL_MAX] = {
+	[CH340_CTRL_READ_VERSION]	= "read_version",
+	[CH340_CTRL_WRITE_REG]		= "write_reg",
+	[CH340_CTRL_READ_REG]		= "read_reg",
+	[CH340_CTRL_SERIAL_INIT]	= "serial_init",
+	[CH340_CTRL_MODEM_CTRL]		= "modem_ctrl",
+};
+
+/*
+ * Counters bumped on every urb completion, kept per cpu so that busy
+ * ports on different cpus do not share a cache line. Only the owning
+ * cpu writes its copy, with interrupts off; readers add them up.
+ */
+struct ch340_pcpu_stats {
+	u64 rx_bytes;
+	u64 rx_urbs;
+	u64 rx_errors[CH340_ERR_MAX];
+	u64 tx_bytes;
+	u64 tx_urbs;
+	u64 tx_errors[CH340_ERR_MAX];
+	u64 int_urbs;
+	u64 int_errors[CH340_ERR_MAX];
+	/* line errors and modem deltas, reported through TIOCGICOUNT */
+	u64 cts;
+	u64 dsr;
+	u64 rng;
+	u64 dcd;
+	u64 frame;
+	u64 parity;
+	u64 overrun;
+	struct u64_stats_sync syncp;
+};
+
+enum ch340_pipe {
+	CH340_PIPE_RX,
+	CH340_PIPE_TX,
+	CH340_PIPE_INT,
+};
+
+/* log2 latency buckets, bucket i counting times in [2^(i-1), 2^i) ns */
+#define CH340_HIST_BUCKETS	32
+
+struct ch340_hist {
+	u64 count[CH340_HIST_BUCKETS];
+};
+
+/* RX delivery times, per cpu for the same reason as ch340_pcpu_stats */
+struct ch340_pcpu_hist {
+	struct ch340_hist rx;
+	struct u64_stats_sync syncp;
+};
+
+/*
+ * A snapshot of the per-port counters. The rest are protected by
+ * stats_lock; those shared with ch340_pcpu_stats are only filled in
+ * by ch340_stats_read.
+ */
+struct ch340_stats {
+	u64 rx_bytes;
+	u64 rx_urbs;
+	u64 rx_errors[CH340_ERR_MAX];
+	u64 rx_resubmit_failed;
+	u64 tx_bytes;
+	u64 tx_urbs;
+	u64 tx_errors[CH340_ERR_MAX];
+	u64 int_urbs;
+	u64 int_errors[CH340_ERR_MAX];
+	u64 cts;
+	u64 dsr;
+	u64 rng;
+	u64 dcd;
+	u64 frame;
+	u64 parity;
+	u64 overrun;
+	u64 int_resubmit_failed;
+	u64 int_backoffs;
+	u64 int_degraded;
+	u64 ctrl_requests;
+	u64 ctrl_by_request[CH340_CTRL_MAX];
+	u64 ctrl_errors;
+	u64 ctrl_skipped;
+	u64 ctrl_coalesced;
+	/* round trip of completed control requests, submit to callback */
+	u64 ctrl_completed;
+	u64 ctrl_time_total;
+	u64 ctrl_time_min;
+	u64 ctrl_time_max;
+	/* time between successive interrupt completions */
+	u64 int_intervals;
+	u64 int_interval_total;
+	u64 int_interval_min;
+	u64 int_interval_max;
+
+	u64 pm_suspends;
+	u64 pm_resumes;
+	u64 pm_resume_time_total;
+	u64 pm_resume_time_min;
+	u64 pm_resume_time_max;
+};
+
 struct ch340_private {
 	spinlock_t lock; /* access lock */
+	/*
+	 * Serialises the changes that program the divisor and LCR: termios,
+	 * rx_mode and break. Also held while RTS changes hands between
+	 * CRTSCTS, RS485 and a modem control sequence.
+	 */
+	struct mutex line_mutex;
 	unsigned baud_rate; /* set baud rate */
-	u8 mcr;
-	u8 msr;
+	unsigned baud_actual; /* rate the divisor really gives */
+	/*
+	 * Modem control and status, and line errors not yet reported with
+	 * received data, are accessed without taking the lock.
+	 */
+	atomic_t mcr;
+	atomic_t msr;
+	atomic_t lsr;
 	u8 lcr;
+	bool break_on;
+	bool crtscts;
+	enum ch340_rx_mode rx_mode;
+	u8 version;
+	const struct ch340_chip *chip;
+	unsigned long quirks;
+
+	/*
+	 * Control requests are queued and submitted one at a time from a
+	 * single urb, so they reach the chip in order. Protected by ctrl_lock,
+	 * as is the shadow of the last value queued for each chip register
+	 * and for the modem control lines, used to skip writes that change
+	 * nothing.
+	 */
+	spinlock_t ctrl_lock;
+	struct urb *ctrl_urb;
+	struct usb_ctrlrequest *ctrl_setup;
+	u8 *ctrl_buf;
+	struct ch340_ctrl_req ctrl_queue[CH340_CTRL_QUEUE_LEN];
+	unsigned int ctrl_head;
+	unsigned int ctrl_count;
+	bool ctrl_busy;
+	bool ctrl_unlinking;	/* no submissions while a waiter unlinks */
+	wait_queue_head_t ctrl_wait;
+	u8 regs[CH340_NUM_REGS];
+	DECLARE_BITMAP(regs_valid, CH340_NUM_REGS);
+	u8 mcr_hw;
+	bool mcr_hw_valid;
+	ktime_t ctrl_submitted;
+	ktime_t int_completed;
+
+	/*
+	 * With int_park set, the interrupt urb only runs while something
+	 * needs modem status: carrier detect or flow control in termios, a
+	 * TIOCMIWAIT waiter or the PPS source. Protected by int_mutex.
+	 */
+	struct mutex int_mutex;
+	bool int_park;
+	bool int_open;
+	bool int_running;
+
+	/*
+	 * Runtime PM: an open port gives up the reference the core holds
+	 * for it, and the traffic that needs the device takes its own.
+	 * suspended and tx_pm are protected by port->lock, int_pm by
+	 * int_mutex.
+	 */
+	bool pm_idle;
+	bool suspended;
+	bool tx_pm;
+	bool int_pm;
+
+	/* serialises modem control sequences */
+	struct mutex mcr_seq_mutex;
+	bool int_termios;
+	unsigned int int_waiters;
+
+	/* delayed resubmission after interrupt urb errors */
+	struct delayed_work int_work;
+	struct usb_serial_port *port;
+	unsigned int int_errors;
+	int int_last_error;
+
+	/* PPS source fed by DCD edges, stamped at interrupt completion */
+	struct pps_device *pps;
+	struct pps_event_time pps_ts;
+
+	spinlock_t stats_lock;
+	struct ch340_stats stats;
+	struct ch340_pcpu_stats __percpu *pcpu_stats;
+	/*
+	 * Histograms: per cpu RX delivery, reported relative to the sums at
+	 * the last reset since other cpus' copies cannot be cleared safely,
+	 * and control round trips, both protected by stats_lock.
+	 */
+	struct ch340_pcpu_hist __percpu *pcpu_hist;
+	struct ch340_hist rx_hist_base;
+	struct ch340_hist ctrl_hist;
+	struct dentry *debugfs;
+
+	unsigned long flags;
+
+	/* bulk-in read ring, sized at open from rx_urb_count/rx_buf_size */
+	unsigned int rx_urb_count;
+	unsigned int rx_buf_size;
+	unsigned int rx_urbs_active;
+	unsigned long rx_urbs_free;
+	struct urb *rx_urbs[CH340_RX_URBS_MAX];
+	ktime_t rx_submitted[CH340_RX_URBS_MAX];
+
+	/*
+	 * bulk-out write queue, sized at open; the free mask and the
+	 * counters are protected by port->lock
+	 */
+	unsigned int tx_urb_count;
+	unsigned int tx_buf_size;
+	unsigned int tx_urbs_active;
+	unsigned int tx_urb_size;
+	unsigned int tx_maxp;
+	unsigned long tx_urbs_free;
+	unsigned long tx_urbs_mask;
+	struct urb *tx_urbs[CH340_TX_URBS_MAX];
+	ktime_t tx_submitted[CH340_TX_URBS_MAX];
+	unsigned long tx_writes;
+	unsigned long tx_urbs_sent;
+	unsigned long tx_packets;
+	unsigned long tx_deferred;
+
+	/*
+	 * when the chip is expected to have sent the last byte it accepted,
+	 * and the time one character takes on the line
+	 */
+	ktime_t tx_idle;
+	unsigned int tx_char_ns;
+	struct hrtimer tx_idle_timer;
+
+	/* RS485 settings and direction state, protected by port->lock */
+	struct serial_rs485 rs485;
+	enum ch340_rs485_state rs485_state;
+	struct work_struct rs485_work;
+	struct hrtimer rs485_timer;
 };
 
 static void ch340_set_termios(struct tty_struct *tty,
 			      struct usb_serial_port *port,
 			      struct ktermios *old_termios);
 
-static int ch340_control_out(struct usb_device *dev, u8 request,
-			     u16 value, u16 index)
+static unsigned int ch340_err_index(int status)
 {
-	int r;
+	switch (status) {
+	case -EPROTO:
+		return CH340_ERR_EPROTO;
+	case -EILSEQ:
+		return CH340_ERR_EILSEQ;
+	case -ETIME:
+		return CH340_ERR_ETIME;
+	case -EPIPE:
+		return CH340_ERR_EPIPE;
+	case -EOVERFLOW:
+		return CH340_ERR_EOVERFLOW;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		return CH340_ERR_STOPPED;
+	default:
+		return CH340_ERR_OTHER;
+	}
+}
 
-	dev_dbg(&dev->dev, "%s - (%02x,%04x,%04x)\n", __func__,
-		request, value, index);
+static struct ch340_pcpu_stats *ch340_stats_begin(struct ch340_private *priv,
+						  unsigned long *flags)
+{
+	struct ch340_pcpu_stats *pcpu;
 
-	r = usb_control_msg(dev, usb_sndctrlpipe(dev, 0), request,
-			    USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_OUT,
-			    value, index, NULL, 0, DEFAULT_TIMEOUT);
-	if (r < 0)
-		dev_err(&dev->dev, "failed to send control message: %d\n", r);
+	/* completions may run in hard or soft irq context on the same cpu */
+	local_irq_save(*flags);
+	pcpu = this_cpu_ptr(priv->pcpu_stats);
+	u64_stats_update_begin(&pcpu->syncp);
 
-	return r;
+	return pcpu;
 }
 
-static int ch340_control_in(struct usb_device *dev,
-			    u8 request, u16 value, u16 index,
-			    char *buf, unsigned bufsize)
+static void ch340_stats_end(struct ch340_pcpu_stats *pcpu,
+			    unsigned long flags)
 {
-	int r;
-
-	dev_dbg(&dev->dev, "%s - (%02x,%04x,%04x,%u)\n", __func__,
-		request, value, index, bufsize);
+	u64_stats_update_end(&pcpu->syncp);
+	local_irq_restore(flags);
+}
 
-	r = usb_control_msg(dev, usb_rcvctrlpipe(dev, 0), request,
-			    USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_IN,
-			    value, index, buf, bufsize, DEFAULT_TIMEOUT);
-	if (r < (int)bufsize) {
-		if (r >= 0) {
-			dev_err(&dev->dev,
-				"short control message received (%d < %u)\n",
-				r, bufsize);
-			r = -EIO;
-		}
+/* Count a bulk or interrupt urb completion, in bytes on success. */
+static void ch340_stats_urb(struct ch340_private *priv, enum ch340_pipe pipe,
+			    int status, unsigned int len)
+{
+	struct ch340_pcpu_stats *pcpu;
+	unsigned long flags;
+	u64 *errors;
+	u64 *urbs;
+	u64 *bytes;
 
-		dev_err(&dev->dev, "failed to receive control message: %d\n",
-			r);
-		return r;
+	pcpu = ch340_stats_begin(priv, &flags);
+	switch (pipe) {
+	case CH340_PIPE_RX:
+		urbs = &pcpu->rx_urbs;
+		bytes = &pcpu->rx_bytes;
+		errors = pcpu->rx_errors;
+		break;
+	case CH340_PIPE_TX:
+		urbs = &pcpu->tx_urbs;
+		bytes = &pcpu->tx_bytes;
+		errors = pcpu->tx_errors;
+		break;
+	default:
+		urbs = &pcpu->int_urbs;
+		bytes = NULL;
+		errors = pcpu->int_errors;
+		break;
 	}
 
-	return 0;
+	if (status) {
+		errors[ch340_err_index(status)]++;
+	} else {
+		(*urbs)++;
+		if (bytes)
+			*bytes += len;
+	}
+	ch340_stats_end(pcpu, flags);
 }
 
-static int ch340_set_baudrate_lcr(struct usb_device *dev,
-				  struct ch340_private *priv, u8 lcr)
+static void ch340_stats_inc(struct ch340_private *priv, u64 *counter)
 {
-	short a;
-	int r;
-	unsigned int factor, diff, res;
-	short divisor, div;
-	unsigned int best_factor, best_divisor, best_diff;
-	bool x2 = 0;
+	unsigned long flags;
 
-	if (!priv->baud_rate)
-		return -EINVAL;
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	(*counter)++;
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
+}
 
-	/* Calcule without x2 multiplier */
-	factor = DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR, priv->baud_rate);
-	divisor = CH340_BAUDBASE_DIVMAX;
-	div = 1;
+static void ch340_stats_ctrl_request(struct ch340_private *priv, u8 request)
+{
+	struct ch340_stats *stats = &priv->stats;
+	unsigned long flags;
+	int i;
 
-	while ((factor > 0xff) && divisor) {
-		factor >>= 3;
-		divisor--;
-		div <<= 3;
+	switch (request) {
+	case CH340_REQ_READ_VERSION:
+		i = CH340_CTRL_READ_VERSION;
+		break;
+	case CH340_REQ_WRITE_REG:
+		i = CH340_CTRL_WRITE_REG;
+		break;
+	case CH340_REQ_READ_REG:
+		i = CH340_CTRL_READ_REG;
+		break;
+	case CH340_REQ_SERIAL_INIT:
+		i = CH340_CTRL_SERIAL_INIT;
+		break;
+	default:
+		i = CH340_CTRL_MODEM_CTRL;
+		break;
 	}
 
-	dev_dbg(&dev->dev, "clk: x1, factor: %lu, divisor: %d (/%d)\n", factor, divisor, div);
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	stats->ctrl_requests++;
+	stats->ctrl_by_request[i]++;
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
+}
+
+static void ch340_hist_add(struct ch340_hist *hist, u64 ns)
+{
+	hist->count[min_t(int, fls64(ns), CH340_HIST_BUCKETS - 1)]++;
+}
 
-	res = DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR, factor * div);
-	diff = (res > priv->baud_rate) ? (res - priv->baud_rate) : (priv->baud_rate - res);
+static void ch340_hist_rx(struct ch340_private *priv, ktime_t start)
+{
+	struct ch340_pcpu_hist *pcpu;
+	unsigned long flags;
+	u64 t;
 
-	dev_dbg(&dev->dev, "%u - %lu = %lu\n", priv->baud_rate, res, diff);
+	t = ktime_to_ns(ktime_sub(ktime_get(), start));
 
-	best_factor = factor;
-	best_divisor = divisor;
-	best_diff = diff;
+	local_irq_save(flags);
+	pcpu = this_cpu_ptr(priv->pcpu_hist);
+	u64_stats_update_begin(&pcpu->syncp);
+	ch340_hist_add(&pcpu->rx, t);
+	u64_stats_update_end(&pcpu->syncp);
+	local_irq_restore(flags);
+}
 
+static void ch340_hist_read_rx(struct ch340_private *priv,
+			       struct ch340_hist *sum)
+{
+	struct ch340_pcpu_hist *pcpu;
+	struct ch340_hist v;
+	unsigned int start;
+	int cpu;
+	int i;
 
+	memset(sum, 0, sizeof(*sum));
 
-	/* Check x2 multiplier */
-	factor = DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR * 2, priv->baud_rate);
-	divisor = CH340_BAUDBASE_DIVMAX;
-	div = 1;
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(priv->pcpu_hist, cpu);
+		do {
+			start = u64_stats_fetch_begin_irq(&pcpu->syncp);
+			v = pcpu->rx;
+		} while (u64_stats_fetch_retry_irq(&pcpu->syncp, start));
 
-	while ((factor > 0xff) && divisor) {
-		factor >>= 3;
-		divisor--;
-		div <<= 3;
+		for (i = 0; i < CH340_HIST_BUCKETS; i++)
+			sum->count[i] += v.count[i];
 	}
+}
 
-	if (factor > 8) {
-		dev_dbg(&dev->dev, "clk: x2, factor: %lu, divisor: %d (/%d)\n", factor, divisor, div);
+/* Add up the per cpu counters, for TIOCGICOUNT and the stats files. */
+static void ch340_stats_read_pcpu(struct ch340_private *priv,
+				  struct ch340_pcpu_stats *sum)
+{
+	struct ch340_pcpu_stats *pcpu;
+	struct ch340_pcpu_stats v;
+	unsigned int start;
+	int cpu;
+	int i;
 
-		res = DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR * 2, factor * div);
-		diff = (res > priv->baud_rate) ? (res - priv->baud_rate) : (priv->baud_rate - res);
+	memset(sum, 0, sizeof(*sum));
 
-		dev_dbg(&dev->dev, "%u - %lu = %lu\n", priv->baud_rate, res, diff);
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(priv->pcpu_stats, cpu);
+		do {
+			start = u64_stats_fetch_begin_irq(&pcpu->syncp);
+			v = *pcpu;
+		} while (u64_stats_fetch_retry_irq(&pcpu->syncp, start));
 
-		if (diff < best_diff) {
-			best_factor = factor;
-			best_divisor = divisor;
-			x2 = 1;
+		sum->rx_bytes += v.rx_bytes;
+		sum->rx_urbs += v.rx_urbs;
+		sum->tx_bytes += v.tx_bytes;
+		sum->tx_urbs += v.tx_urbs;
+		sum->int_urbs += v.int_urbs;
+		for (i = 0; i < CH340_ERR_MAX; i++) {
+			sum->rx_errors[i] += v.rx_errors[i];
+			sum->tx_errors[i] += v.tx_errors[i];
+			sum->int_errors[i] += v.int_errors[i];
 		}
-	} else {
-		dev_dbg(&dev->dev, "factor is too small for x2 multiplier\n");
+		sum->cts += v.cts;
+		sum->dsr += v.dsr;
+		sum->rng += v.rng;
+		sum->dcd += v.dcd;
+		sum->frame += v.frame;
+		sum->parity += v.parity;
+		sum->overrun += v.overrun;
 	}
+}
 
+static void ch340_stats_read(struct ch340_private *priv,
+			     struct ch340_stats *stats)
+{
+	struct ch340_pcpu_stats sum;
+	unsigned long flags;
 
-	factor = 0x100 - best_factor;
-	if (factor > 0xfe)
-		return -EINVAL;
+	ch340_stats_read_pcpu(priv, &sum);
 
-	a = (factor << 8) | best_divisor | (x2 << 2);
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	*stats = priv->stats;
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
 
-	/*
-	 * CH340A buffers data until a full endpoint-size packet (32 bytes)
-	 * has been received unless bit 7 is set.
-	 */
-	a |= BIT(7);
+	stats->rx_bytes = sum.rx_bytes;
+	stats->rx_urbs = sum.rx_urbs;
+	memcpy(stats->rx_errors, sum.rx_errors, sizeof(stats->rx_errors));
+	stats->tx_bytes = sum.tx_bytes;
+	stats->tx_urbs = sum.tx_urbs;
+	memcpy(stats->tx_errors, sum.tx_errors, sizeof(stats->tx_errors));
+	stats->int_urbs = sum.int_urbs;
+	memcpy(stats->int_errors, sum.int_errors, sizeof(stats->int_errors));
+	stats->cts = sum.cts;
+	stats->dsr = sum.dsr;
+	stats->rng = sum.rng;
+	stats->dcd = sum.dcd;
+	stats->frame = sum.frame;
+	stats->parity = sum.parity;
+	stats->overrun = sum.overrun;
+}
 
-	r = ch340_control_out(dev, CH340_REQ_WRITE_REG, 0x1312, a);
-	if (r)
-		return r;
+static void ch340_ctrl_kick(struct ch340_private *priv);
 
-	r = ch340_control_out(dev, CH340_REQ_WRITE_REG, 0x2518, lcr);
-	if (r)
-		return r;
+/*
+ * Complete the request at the head of the control queue.
+ * Called with ctrl_lock held.
+ */
+static void ch340_ctrl_finish(struct ch340_private *priv, int status)
+{
+	struct ch340_ctrl_req *req = &priv->ctrl_queue[priv->ctrl_head];
+	struct usb_device *dev = priv->ctrl_urb->dev;
 
-	return r;
-}
+	if (trace_ch340_control_enabled()) {
+		trace_ch340_control(&dev->dev, req->request, req->value,
+				    req->index, req->size, status,
+				    ktime_to_ns(ktime_sub(ktime_get(),
+						priv->ctrl_submitted)));
+	}
 
-static int ch340_set_handshake(struct usb_device *dev, u8 control)
-{
-	return ch340_control_out(dev, CH340_REQ_MODEM_CTRL, ~control, 0);
+	if (status) {
+		ch340_stats_inc(priv, &priv->stats.ctrl_errors);
+
+		/*
+		 * A stalled register read means the chip lacks the register,
+		 * which callers probing for it handle themselves.
+		 */
+		if (status != -ENOENT && status != -ECONNRESET &&
+		    status != -ESHUTDOWN && status != -ENODEV &&
+		    status != -EPERM &&
+		    !(status == -EPIPE && req->request == CH340_REQ_READ_REG)) {
+			dev_err(&dev->dev, "failed to %s control message (%02x,%04x,%04x): %d\n",
+				req->size ? "receive" : "send", req->request,
+				req->value, req->index, status);
+		}
+
+		/* the chip state is unknown, so the next write must go out */
+		if (req->request == CH340_REQ_WRITE_REG) {
+			clear_bit(req->value & 0xff, priv->regs_valid);
+			clear_bit(req->value >> 8, priv->regs_valid);
+		} else if (req->request == CH340_REQ_MODEM_CTRL) {
+			priv->mcr_hw_valid = false;
+		}
+	} else if (req->size) {
+		memcpy(req->wait->data, priv->ctrl_buf, req->size);
+	}
+
+	if (req->wait) {
+		req->wait->status = status;
+		complete(&req->wait->done);
+	}
+
+	priv->ctrl_head = (priv->ctrl_head + 1) % CH340_CTRL_QUEUE_LEN;
+	priv->ctrl_count--;
+	wake_up(&priv->ctrl_wait);
 }
 
-static int ch340_get_status(struct usb_device *dev, struct ch340_private *priv)
+static void ch340_stats_ctrl_time(struct ch340_private *priv)
 {
-	const unsigned int size = 2;
-	char *buffer;
-	int r;
+	struct ch340_stats *stats = &priv->stats;
 	unsigned long flags;
+	u64 t;
 
-	buffer = kmalloc(size, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	t = ktime_to_ns(ktime_sub(ktime_get(), priv->ctrl_submitted));
 
-	r = ch340_control_in(dev, CH340_REQ_READ_REG, 0x0706, 0, buffer, size);
-	if (r < 0)
-		goto out;
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	stats->ctrl_completed++;
+	stats->ctrl_time_total += t;
+	if (t < stats->ctrl_time_min)
+		stats->ctrl_time_min = t;
+	if (t > stats->ctrl_time_max)
+		stats->ctrl_time_max = t;
+	if (histograms)
+		ch340_hist_add(&priv->ctrl_hist, t);
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
+}
 
-	spin_lock_irqsave(&priv->lock, flags);
-	priv->msr = (~(*buffer)) & CH340_BITS_MODEM_STAT;
-	spin_unlock_irqrestore(&priv->lock, flags);
+static void ch340_stats_int_interval(struct ch340_private *priv, u64 t)
+{
+	struct ch340_stats *stats = &priv->stats;
+	unsigned long flags;
 
-out:	kfree(buffer);
-	return r;
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	stats->int_intervals++;
+	stats->int_interval_total += t;
+	if (t < stats->int_interval_min)
+		stats->int_interval_min = t;
+	if (t > stats->int_interval_max)
+		stats->int_interval_max = t;
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
 }
 
-/* -------------------------------------------------------------------------- */
-
-static int ch340_configure(struct usb_device *dev, struct ch340_private *priv)
+static void ch340_stats_pm_resume(struct ch340_private *priv, ktime_t start)
 {
-	const unsigned int size = 2;
-	char *buffer;
-	int r;
+	struct ch340_stats *stats = &priv->stats;
+	unsigned long flags;
+	u64 t;
 
-	buffer = kmalloc(size, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	t = ktime_to_ns(ktime_sub(ktime_get(), start));
 
-	/* expect two bytes 0x27 0x00 */
-	r = ch340_control_in(dev, CH340_REQ_READ_VERSION, 0, 0, buffer, size);
-	if (r < 0)
-		goto out;
-	dev_dbg(&dev->dev, "Chip version: 0x%02x\n", buffer[0]);
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	stats->pm_resumes++;
+	stats->pm_resume_time_total += t;
+	if (t < stats->pm_resume_time_min)
+		stats->pm_resume_time_min = t;
+	if (t > stats->pm_resume_time_max)
+		stats->pm_resume_time_max = t;
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
+}
 
-	r = ch340_control_out(dev, CH340_REQ_SERIAL_INIT, 0, 0);
-	if (r < 0)
-		goto out;
+static void ch340_ctrl_callback(struct urb *urb)
+{
+	struct ch340_private *priv = urb->context;
+	int status = urb->status;
+	unsigned long flags;
+	unsigned int size;
 
-	r = ch340_set_baudrate_lcr(dev, priv, priv->lcr);
-	if (r < 0)
-		goto out;
+	spin_lock_irqsave(&priv->ctrl_lock, flags);
+	priv->ctrl_busy = false;
 
-	r = ch340_set_handshake(dev, priv->mcr);
+	size = priv->ctrl_queue[priv->ctrl_head].size;
+	if (!status && urb->actual_length < size) {
+		dev_err(&urb->dev->dev,
+			"short control message received (%u < %u)\n",
+			urb->actual_length, size);
+		status = -EIO;
+	}
 
-out:	kfree(buffer);
-	return r;
+	if (!status)
+		ch340_stats_ctrl_time(priv);
+
+	ch340_ctrl_finish(priv, status);
+	ch340_ctrl_kick(priv);
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
 }
 
-static int ch340_port_probe(struct usb_serial_port *port)
+/*
+ * Submit the request at the head of the control queue unless one is
+ * already in flight. Requests complete strictly in the order they were
+ * queued. Called with ctrl_lock held.
+ */
+static void ch340_ctrl_kick(struct ch340_private *priv)
 {
-	struct ch340_private *priv;
+	struct usb_ctrlrequest *setup = priv->ctrl_setup;
+	struct urb *urb = priv->ctrl_urb;
+	struct ch340_ctrl_req *req;
 	int r;
 
-	priv = kzalloc(sizeof(struct ch340_private), GFP_KERNEL);
-	if (!priv)
-		return -ENOMEM;
+	while (!priv->ctrl_busy && !priv->ctrl_unlinking && priv->ctrl_count) {
+		req = &priv->ctrl_queue[priv->ctrl_head];
+		if (req->cancelled) {
+			ch340_ctrl_finish(priv, -ECONNRESET);
+			continue;
+		}
 
-	spin_lock_init(&priv->lock);
-	priv->baud_rate = DEFAULT_BAUD_RATE;
-	/*
-	 * Some CH340 devices appear unable to change the initial LCR
-	 * settings, so set a sane 8N1 default.
-	 */
-	priv->lcr = CH340_LCR_ENABLE_RX | CH340_LCR_ENABLE_TX | CH340_LCR_CS8;
+		dev_dbg(&urb->dev->dev, "%s - (%02x,%04x,%04x,%u)\n", __func__,
+			req->request, req->value, req->index, req->size);
 
-	r = ch340_configure(port->serial->dev, priv);
-	if (r < 0)
-		goto error;
+		setup->bRequestType = USB_TYPE_VENDOR | USB_RECIP_DEVICE |
+				(req->size ? USB_DIR_IN : USB_DIR_OUT);
+		setup->bRequest = req->request;
+		setup->wValue = cpu_to_le16(req->value);
+		setup->wIndex = cpu_to_le16(req->index);
+		setup->wLength = cpu_to_le16(req->size);
 
-	usb_set_serial_port_data(port, priv);
-	return 0;
+		urb->pipe = req->size ? usb_rcvctrlpipe(urb->dev, 0) :
+					usb_sndctrlpipe(urb->dev, 0);
+		urb->transfer_buffer_length = req->size;
 
-error:	kfree(priv);
-	return r;
+		ch340_stats_ctrl_request(priv, req->request);
+		priv->ctrl_submitted = ktime_get();
+
+		r = usb_submit_urb(urb, GFP_ATOMIC);
+		if (r == 0) {
+			priv->ctrl_busy = true;
+			break;
+		}
+
+		ch340_ctrl_finish(priv, r);
+	}
 }
 
-static int ch340_port_remove(struct usb_serial_port *port)
+/* Take ctrl_lock once the control queue has room for another request. */
+static void ch340_ctrl_lock_space(struct ch340_private *priv,
+				  unsigned long *flags)
 {
-	struct ch340_private *priv;
-
-	priv = usb_get_serial_port_data(port);
-	kfree(priv);
+	for (;;) {
+		spin_lock_irqsave(&priv->ctrl_lock, *flags);
+		if (priv->ctrl_count < CH340_CTRL_QUEUE_LEN)
+			return;
+		spin_unlock_irqrestore(&priv->ctrl_lock, *flags);
 
-	return 0;
+		wait_event(priv->ctrl_wait,
+			   READ_ONCE(priv->ctrl_count) < CH340_CTRL_QUEUE_LEN);
+	}
 }
 
-static int ch340_carrier_raised(struct usb_serial_port *port)
+/*
+ * Append a request to the control queue; wait may be NULL for requests
+ * whose result nobody needs. Called with ctrl_lock held and room in the
+ * queue.
+ */
+static void ch340_ctrl_queue(struct ch340_private *priv, u8 request,
+			     u16 value, u16 index, u16 size,
+			     struct ch340_ctrl_wait *wait)
 {
-	struct ch340_private *priv = usb_get_serial_port_data(port);
-	if (priv->msr & CH340_BIT_DCD)
-		return 1;
-	return 0;
+	unsigned int tail;
+	struct ch340_ctrl_req *req;
+
+	tail = (priv->ctrl_head + priv->ctrl_count) % CH340_CTRL_QUEUE_LEN;
+	req = &priv->ctrl_queue[tail];
+	req->request = request;
+	req->value = value;
+	req->index = index;
+	req->size = size;
+	req->wait = wait;
+	req->cancelled = false;
+	priv->ctrl_count++;
+
+	ch340_ctrl_kick(priv);
 }
 
-static void ch340_dtr_rts(struct usb_serial_port *port, int on)
+static void ch340_ctrl_init_wait(struct ch340_ctrl_wait *wait, void *data)
 {
-	struct ch340_private *priv = usb_get_serial_port_data(port);
+	init_completion(&wait->done);
+	wait->data = data;
+	wait->status = 0;
+}
+
+/*
+ * Wait for a queued request. A request that does not complete in time is
+ * unlinked, which also lets the rest of the queue make progress.
+ */
+/*
+ * Give up on the request behind wait. The urb is only unlinked while it
+ * carries that request, and nothing is submitted until the unlink has
+ * been issued; a request still queued behind another is dropped instead.
+ */
+static void ch340_ctrl_cancel(struct ch340_private *priv,
+			      struct ch340_ctrl_wait *wait)
+{
+	struct ch340_ctrl_req *req;
+	unsigned long flags;
+	bool unlink = false;
+	unsigned int i;
+
+	spin_lock_irqsave(&priv->ctrl_lock, flags);
+	for (i = 0; i < priv->ctrl_count; i++) {
+		req = &priv->ctrl_queue[(priv->ctrl_head + i) %
+					CH340_CTRL_QUEUE_LEN];
+		if (req->wait != wait)
+			continue;
+
+		if (i == 0 && priv->ctrl_busy) {
+			priv->ctrl_unlinking = true;
+			unlink = true;
+		} else {
+			req->wait = NULL;
+			req->cancelled = true;
+			wait->status = -ETIMEDOUT;
+			complete(&wait->done);
+		}
+		break;
+	}
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+
+	if (!unlink)
+		return;
+
+	/* the completion takes ctrl_lock, and may run before this returns */
+	usb_unlink_urb(priv->ctrl_urb);
+
+	spin_lock_irqsave(&priv->ctrl_lock, flags);
+	priv->ctrl_unlinking = false;
+	ch340_ctrl_kick(priv);
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+}
+
+static int ch340_ctrl_wait(struct ch340_private *priv,
+			   struct ch340_ctrl_wait *wait)
+{
+	unsigned long timeout = msecs_to_jiffies(DEFAULT_TIMEOUT);
+	bool timed_out = false;
+
+	while (!wait_for_completion_timeout(&wait->done, timeout)) {
+		timed_out = true;
+		ch340_ctrl_cancel(priv, wait);
+	}
+
+	if (timed_out && wait->status == -ECONNRESET)
+		return -ETIMEDOUT;
+
+	return wait->status;
+}
+
+/* Wait for every queued control request to complete. */
+static void ch340_ctrl_flush(struct ch340_private *priv)
+{
+	if (!wait_event_timeout(priv->ctrl_wait, !READ_ONCE(priv->ctrl_count),
+				msecs_to_jiffies(DEFAULT_TIMEOUT)))
+		usb_kill_urb(priv->ctrl_urb);
+}
+
+/*
+ * Control reads go through the per-port buffer allocated at probe; the
+ * result is copied to buf, which need not be suitable for DMA.
+ */
+static int ch340_control_in(struct usb_device *dev,
+			    struct ch340_private *priv,
+			    u8 request, u16 value, u16 index,
+			    void *buf, unsigned bufsize)
+{
+	struct ch340_ctrl_wait wait;
+	unsigned long flags;
+
+	if (WARN_ON(bufsize > CH340_CTRL_BUF_SIZE))
+		return -EINVAL;
+
+	ch340_ctrl_init_wait(&wait, buf);
+
+	ch340_ctrl_lock_space(priv, &flags);
+	ch340_ctrl_queue(priv, request, value, index, bufsize, &wait);
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+
+	return ch340_ctrl_wait(priv, &wait);
+}
+
+static void ch340_invalidate_shadow(struct ch340_private *priv)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->ctrl_lock, flags);
+	bitmap_zero(priv->regs_valid, CH340_NUM_REGS);
+	priv->mcr_hw_valid = false;
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+}
+
+static bool ch340_reg_cached(struct ch340_private *priv, u8 reg, u8 val)
+{
+	return test_bit(reg, priv->regs_valid) && priv->regs[reg] == val;
+}
+
+/*
+ * Queue a write of a pair of chip registers: the low byte of val goes to
+ * the register in the low byte of reg, the high byte to the register in
+ * the high byte. The shadow tracks the last queued value, and the write is
+ * skipped (returning false) if both registers already hold the requested
+ * values.
+ */
+static bool __ch340_write_reg(struct ch340_private *priv, u16 reg, u16 val,
+			      struct ch340_ctrl_wait *wait)
+{
+	u8 reg1 = reg & 0xff, reg2 = reg >> 8;
+	u8 val1 = val & 0xff, val2 = val >> 8;
+	unsigned long flags;
+
+	ch340_ctrl_lock_space(priv, &flags);
+	if (ch340_reg_cached(priv, reg1, val1) &&
+	    ch340_reg_cached(priv, reg2, val2)) {
+		spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+		ch340_stats_inc(priv, &priv->stats.ctrl_skipped);
+		return false;
+	}
+
+	priv->regs[reg1] = val1;
+	priv->regs[reg2] = val2;
+	set_bit(reg1, priv->regs_valid);
+	set_bit(reg2, priv->regs_valid);
+
+	ch340_ctrl_queue(priv, CH340_REQ_WRITE_REG, reg, val, 0, wait);
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+
+	return true;
+}
+
+static int ch340_write_reg(struct usb_device *dev, struct ch340_private *priv,
+			   u16 reg, u16 val)
+{
+	struct ch340_ctrl_wait wait;
+
+	ch340_ctrl_init_wait(&wait, NULL);
+
+	if (!__ch340_write_reg(priv, reg, val, &wait)) {
+		dev_dbg(&dev->dev, "%s - skipping (%04x,%04x)\n", __func__,
+			reg, val);
+		return 0;
+	}
+
+	return ch340_ctrl_wait(priv, &wait);
+}
+
+static void ch340_write_reg_async(struct usb_device *dev,
+				  struct ch340_private *priv, u16 reg, u16 val)
+{
+	if (!__ch340_write_reg(priv, reg, val, NULL)) {
+		dev_dbg(&dev->dev, "%s - skipping (%04x,%04x)\n", __func__,
+			reg, val);
+	}
+}
+
+/* Read a pair of chip registers into buf[2]. */
+static int ch340_read_reg(struct usb_device *dev, struct ch340_private *priv,
+			  u16 reg, u8 *buf)
+{
+	u8 reg1 = reg & 0xff, reg2 = reg >> 8;
+	unsigned long flags;
+	int r;
+
+	r = ch340_control_in(dev, priv, CH340_REQ_READ_REG, reg, 0, buf, 2);
+	if (r < 0)
+		return r;
+
+	/*
+	 * Seed the shadow of registers that have not been written since it
+	 * was last invalidated; a write queued after this read has already
+	 * updated the shadow with a newer value.
+	 */
+	spin_lock_irqsave(&priv->ctrl_lock, flags);
+	if (!test_and_set_bit(reg1, priv->regs_valid))
+		priv->regs[reg1] = buf[0];
+	if (!test_and_set_bit(reg2, priv->regs_valid))
+		priv->regs[reg2] = buf[1];
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+
+	return 0;
+}
+
+/*
+ * Queue a modem control update. An update that has not been submitted yet
+ * is simply replaced, so a burst of changes costs a single transfer.
+ */
+static bool __ch340_set_handshake(struct ch340_private *priv,
+				  struct ch340_ctrl_wait *wait)
+{
+	struct ch340_ctrl_req *tail;
+	unsigned long flags;
+	u8 control;
+
+	/*
+	 * Read the lines under ctrl_lock, so that of concurrent updates the
+	 * one queued last also carries the newest value.
+	 */
+	ch340_ctrl_lock_space(priv, &flags);
+	control = atomic_read(&priv->mcr);
+	if (priv->mcr_hw_valid && priv->mcr_hw == control) {
+		spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+		ch340_stats_inc(priv, &priv->stats.ctrl_skipped);
+		return false;
+	}
+
+	priv->mcr_hw = control;
+	priv->mcr_hw_valid = true;
+
+	tail = &priv->ctrl_queue[(priv->ctrl_head + priv->ctrl_count - 1) %
+				 CH340_CTRL_QUEUE_LEN];
+	if (!wait && priv->ctrl_count > 1 &&
+	    tail->request == CH340_REQ_MODEM_CTRL && !tail->wait &&
+	    !tail->cancelled) {
+		tail->value = (u8)~control;
+		spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+		ch340_stats_inc(priv, &priv->stats.ctrl_coalesced);
+		return true;
+	}
+
+	ch340_ctrl_queue(priv, CH340_REQ_MODEM_CTRL, (u8)~control, 0, 0, wait);
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+
+	return true;
+}
+
+static void ch340_set_handshake_async(struct ch340_private *priv)
+{
+	__ch340_set_handshake(priv, NULL);
+}
+
+/* Update the modem control lines and wait until the chip has done it. */
+static int ch340_set_handshake_wait(struct ch340_private *priv)
+{
+	struct ch340_ctrl_wait wait;
+
+	ch340_ctrl_init_wait(&wait, NULL);
+	if (!__ch340_set_handshake(priv, &wait))
+		return 0;
+
+	return ch340_ctrl_wait(priv, &wait);
+}
+
+/* Set and clear modem control lines; returns the new value. */
+static u8 ch340_update_mcr(struct ch340_private *priv, u8 set, u8 clear)
+{
+	int old, new;
+
+	do {
+		old = atomic_read(&priv->mcr);
+		new = (old & ~clear) | set;
+	} while (atomic_cmpxchg(&priv->mcr, old, new) != old);
+
+	return new;
+}
+
+static void ch340_batch_init(struct ch340_ctrl_batch *batch)
+{
+	batch->count = 0;
+	batch->err = 0;
+}
+
+/* Record an error found while building the batch; the first one wins. */
+static void ch340_batch_error(struct ch340_ctrl_batch *batch, int err)
+{
+	if (!batch->err)
+		batch->err = err;
+}
+
+static struct ch340_ctrl_wait *ch340_batch_add(struct ch340_ctrl_batch *batch,
+					       void *data)
+{
+	struct ch340_ctrl_wait *wait;
+
+	if (WARN_ON(batch->count == CH340_CTRL_BATCH_LEN)) {
+		ch340_batch_error(batch, -ENOSPC);
+		return NULL;
+	}
+
+	wait = &batch->waits[batch->count++];
+	ch340_ctrl_init_wait(wait, data);
+
+	return wait;
+}
+
+/* buf, if size is nonzero, receives the data of a control read */
+static void ch340_batch_control(struct ch340_private *priv,
+				struct ch340_ctrl_batch *batch, u8 request,
+				u16 value, u16 index, void *buf, u16 size)
+{
+	struct ch340_ctrl_wait *wait;
+	unsigned long flags;
+
+	if (WARN_ON(size > CH340_CTRL_BUF_SIZE)) {
+		ch340_batch_error(batch, -EINVAL);
+		return;
+	}
+
+	wait = ch340_batch_add(batch, buf);
+	if (!wait)
+		return;
+
+	ch340_ctrl_lock_space(priv, &flags);
+	ch340_ctrl_queue(priv, request, value, index, size, wait);
+	spin_unlock_irqrestore(&priv->ctrl_lock, flags);
+}
+
+static void ch340_batch_write_reg(struct ch340_private *priv,
+				  struct ch340_ctrl_batch *batch,
+				  u16 reg, u16 val)
+{
+	struct ch340_ctrl_wait *wait;
+
+	wait = ch340_batch_add(batch, NULL);
+	if (wait && !__ch340_write_reg(priv, reg, val, wait))
+		batch->count--;
+}
+
+static void ch340_batch_set_handshake(struct ch340_private *priv,
+				      struct ch340_ctrl_batch *batch)
+{
+	struct ch340_ctrl_wait *wait;
+
+	wait = ch340_batch_add(batch, NULL);
+	if (wait && !__ch340_set_handshake(priv, wait))
+		batch->count--;
+}
+
+/*
+ * Wait for every request in the batch, and return the first error found
+ * while building it or else the status of the first request that failed.
+ */
+static int ch340_batch_wait(struct ch340_private *priv,
+			    struct ch340_ctrl_batch *batch)
+{
+	int r = batch->err;
+	int status;
+	int i;
+
+	for (i = 0; i < batch->count; ++i) {
+		status = ch340_ctrl_wait(priv, &batch->waits[i]);
+		if (status && !r)
+			r = status;
+	}
+
+	return r;
+}
+
+/*
+ * Deviation of the rate a setting gives from the requested one, in ppm.
+ * Worked out from the divisor itself, as the rounded rate hides the error
+ * at low rates.
+ */
+static int ch340_baud_error_ppm(const struct ch340_baud_entry *set)
+{
+	s64 clock = (s64)CH340_BAUDBASE_FACTOR << set->x2;
+	s64 div = (s64)set->factor <<
+		  (3 * (CH340_BAUDBASE_DIVMAX - set->divisor));
+
+	if (!set->rate)
+		return 0;
+
+	return div64_s64((clock - set->rate * div) * 1000000, set->rate * div);
+}
+
+static bool ch340_rx_low_latency(struct ch340_private *priv)
+{
+	switch (priv->rx_mode) {
+	case CH340_RX_MODE_LATENCY:
+		return true;
+	case CH340_RX_MODE_THROUGHPUT:
+		return false;
+	default:
+		return priv->baud_rate < CH340_RX_MODE_AUTO_BAUD;
+	}
+}
+
+/*
+ * Check a rate asked for through termios against baud_tolerance. Only new
+ * requests are checked; the default and cached rates are always restored.
+ */
+static int ch340_baud_check_tolerance(struct usb_serial_port *port,
+				      struct ch340_private *priv,
+				      unsigned int rate)
+{
+	struct ch340_baud_entry set;
+	unsigned int actual;
+	int ppm;
+
+	if (!baud_tolerance)
+		return 0;
+
+	actual = ch340_calc_baud(rate,
+				 priv->quirks & CH340_QUIRK_LIMITED_PRESCALER,
+				 &set);
+	if (!actual)
+		return 0; /* refused by ch340_baud_reg() */
+
+	ppm = ch340_baud_error_ppm(&set);
+	if (abs(ppm) > baud_tolerance) {
+		dev_warn(&port->dev, "%u baud would be %u baud (%d ppm), beyond the tolerance of %u ppm\n",
+			 rate, actual, ppm, baud_tolerance);
+		return -ERANGE;
+	}
+
+	return 0;
+}
+
+/*
+ * Work out the divisor register pair (0x1312) for priv->baud_rate, and the
+ * rate it really gives.
+ */
+static int ch340_baud_reg(struct usb_device *dev, struct ch340_private *priv,
+			  u16 *reg, unsigned int *actual_rate)
+{
+	struct ch340_baud_entry set;
+	unsigned int actual;
+	u16 a;
+
+	if (priv->baud_rate > priv->chip->max_baud) {
+		dev_dbg(&dev->dev, "%s - %u baud is beyond the %s limit of %u\n",
+			__func__, priv->baud_rate, priv->chip->name,
+			priv->chip->max_baud);
+		return -EINVAL;
+	}
+
+	actual = ch340_calc_baud(priv->baud_rate,
+				 priv->quirks & CH340_QUIRK_LIMITED_PRESCALER,
+				 &set);
+	if (!actual)
+		return -EINVAL;
+
+	dev_dbg(&dev->dev, "%s - %u baud: factor %u, divisor %u, x%d -> %u (%d ppm)\n",
+		__func__, priv->baud_rate, set.factor, set.divisor,
+		set.x2 ? 2 : 1, actual, ch340_baud_error_ppm(&set));
+
+	*actual_rate = actual;
+
+	a = ((0x100 - set.factor) << 8) | set.divisor | (set.x2 << 2);
+
+	/*
+	 * CH340A buffers data until a full endpoint-size packet (32 bytes)
+	 * has been received unless bit 7 is set.
+	 */
+	if (ch340_rx_low_latency(priv) !=
+	    !!(priv->quirks & CH340_QUIRK_BUFFERING_INVERTED))
+		a |= BIT(7);
+
+	*reg = a;
+
+	return 0;
+}
+
+/* Queue the divisor and LCR writes for priv->baud_rate and lcr. */
+static void ch340_batch_baudrate_lcr(struct usb_device *dev,
+				     struct ch340_private *priv,
+				     struct ch340_ctrl_batch *batch, u8 lcr,
+				     u16 *reg, unsigned int *actual)
+{
+	int r;
+
+	r = ch340_baud_reg(dev, priv, reg, actual);
+	if (r) {
+		ch340_batch_error(batch, r);
+		return;
+	}
+
+	/* the transmitter stays disabled while a break is being sent */
+	if (priv->break_on)
+		lcr &= ~CH340_LCR_ENABLE_TX;
+
+	ch340_batch_write_reg(priv, batch, 0x1312, *reg);
+	ch340_batch_write_reg(priv, batch, 0x2518, lcr);
+}
+
+/* Time one character takes on the line, with its start and stop bits. */
+static unsigned int ch340_char_ns(unsigned int baud, u8 lcr)
+{
+	unsigned int bits = 1 + 5 + (lcr & CH340_LCR_CS8) + 1;
+
+	if (lcr & CH340_LCR_ENABLE_PAR)
+		bits++;
+	if (lcr & CH340_LCR_STOP_BITS_2)
+		bits++;
+	if (!baud)
+		return 0;
+
+	return DIV_ROUND_UP_ULL((u64)bits * NSEC_PER_SEC, baud);
+}
+
+static int ch340_set_baudrate_lcr(struct usb_device *dev,
+				  struct ch340_private *priv, u8 lcr)
+{
+	struct ch340_ctrl_batch batch;
+	unsigned int actual = 0;
+	ktime_t start = 0;
+	u16 reg = 0;
+	int r;
+
+	if (!priv->baud_rate)
+		return -EINVAL;
+
+	if (trace_ch340_set_baudrate_lcr_enabled())
+		start = ktime_get();
+
+	ch340_batch_init(&batch);
+	ch340_batch_baudrate_lcr(dev, priv, &batch, lcr, &reg, &actual);
+	r = ch340_batch_wait(priv, &batch);
+	if (r == 0) {
+		priv->baud_actual = actual;
+		WRITE_ONCE(priv->tx_char_ns, ch340_char_ns(actual, lcr));
+	}
+
+	if (trace_ch340_set_baudrate_lcr_enabled()) {
+		trace_ch340_set_baudrate_lcr(&dev->dev, priv->baud_rate, actual,
+					     reg, lcr, r,
+					     ktime_to_ns(ktime_sub(ktime_get(),
+							 start)));
+	}
+	return r;
+}
+
+static int ch340_get_status(struct usb_device *dev, struct ch340_private *priv)
+{
+	u8 buffer[2];
+	int r;
+
+	r = ch340_control_in(dev, priv, CH340_REQ_READ_REG, 0x0706, 0,
+			    buffer, sizeof(buffer));
+	if (r < 0)
+		return r;
+
+	atomic_set(&priv->msr, (~(*buffer)) & CH340_BITS_MODEM_STAT);
+
+	return r;
+}
+
+/*
+ * Wake the device, if it autosuspended, for a request from process context
+ * and keep it awake until the matching ch340_pm_put().
+ */
+static int ch340_pm_get(struct usb_serial_port *port)
+{
+	return usb_autopm_get_interface(port->serial->interface);
+}
+
+static void ch340_pm_put(struct usb_serial_port *port)
+{
+	usb_mark_last_busy(port->serial->dev);
+	usb_autopm_put_interface(port->serial->interface);
+}
+
+/*
+ * An open port may only autosuspend if the chip can wake the host when
+ * data arrives.
+ */
+static bool ch340_pm_idle_allowed(struct usb_serial_port *port)
+{
+	struct usb_device *udev = port->serial->dev;
+
+	return autosuspend_delay >= 0 && udev->actconfig &&
+	       (udev->actconfig->desc.bmAttributes & USB_CONFIG_ATT_WAKEUP);
+}
+
+static void ch340_int_reset_errors(struct ch340_private *priv)
+{
+	priv->int_errors = 0;
+	clear_bit(CH340_INT_DEGRADED, &priv->flags);
+}
+
+static bool ch340_int_wanted(struct ch340_private *priv)
+{
+	if (!priv->int_open)
+		return false;
+	if (!priv->int_park)
+		return true;
+
+	return priv->int_termios || priv->int_waiters || priv->pps;
+}
+
+/* Start or park the interrupt urb as needed. Called with int_mutex held. */
+static int ch340_int_update(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	bool want = ch340_int_wanted(priv);
+	int r;
+
+	if (want == priv->int_running)
+		return 0;
+
+	if (!want) {
+		dev_dbg(&port->dev, "%s - parking interrupt urb\n", __func__);
+		WRITE_ONCE(priv->int_running, false);
+		cancel_delayed_work_sync(&priv->int_work);
+		usb_kill_urb(port->interrupt_in_urb);
+		if (priv->int_pm) {
+			priv->int_pm = false;
+			ch340_pm_put(port);
+		}
+		return 0;
+	}
+
+	/* modem status interest keeps the device awake */
+	if (!priv->int_pm) {
+		r = ch340_pm_get(port);
+		if (r)
+			return r;
+		priv->int_pm = true;
+	}
+
+	/*
+	 * The lines may have moved while parked; start from what they are now
+	 * so the first completion does not report those changes as edges.
+	 */
+	r = ch340_get_status(port->serial->dev, priv);
+	if (r < 0) {
+		dev_err(&port->dev, "%s - failed to read modem status: %d\n",
+			__func__, r);
+		priv->int_pm = false;
+		ch340_pm_put(port);
+		return r;
+	}
+
+	dev_dbg(&port->dev, "%s - submitting interrupt urb\n", __func__);
+	ch340_int_reset_errors(priv);
+	priv->int_completed = 0;
+	r = usb_submit_urb(port->interrupt_in_urb, GFP_KERNEL);
+	if (r) {
+		dev_err(&port->dev, "%s - failed to submit interrupt urb: %d\n",
+			__func__, r);
+		priv->int_pm = false;
+		ch340_pm_put(port);
+		return r;
+	}
+	priv->int_running = true;
+
+	return 0;
+}
+
+/*
+ * Retry the interrupt urb after an error, backing off so that a flaky
+ * link cannot turn into a completion storm, or give up on it.
+ */
+static void ch340_int_backoff(struct usb_serial_port *port, int status)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned int delay;
+
+	priv->int_last_error = status;
+
+	if (++priv->int_errors >= CH340_INT_MAX_ERRORS) {
+		if (!test_and_set_bit(CH340_INT_DEGRADED, &priv->flags)) {
+			ch340_stats_inc(priv, &priv->stats.int_degraded);
+			dev_err(&port->dev, "modem status unavailable after %u errors (last %d)\n",
+				priv->int_errors, status);
+		}
+		return;
+	}
+
+	delay = min_t(unsigned int, CH340_INT_BACKOFF_MIN_MS <<
+		      (priv->int_errors - 1), CH340_INT_BACKOFF_MAX_MS);
+	ch340_stats_inc(priv, &priv->stats.int_backoffs);
+	schedule_delayed_work(&priv->int_work, msecs_to_jiffies(delay));
+}
+
+static void ch340_int_work(struct work_struct *work)
+{
+	struct ch340_private *priv = container_of(to_delayed_work(work),
+						  struct ch340_private,
+						  int_work);
+	struct usb_serial_port *port = priv->port;
+	struct urb *urb = port->interrupt_in_urb;
+	int r;
+
+	if (!READ_ONCE(priv->int_running))
+		return;
+
+	if (priv->int_last_error == -EPIPE) {
+		r = usb_clear_halt(urb->dev, urb->pipe);
+		if (r)
+			dev_dbg(&port->dev, "%s - clear halt failed: %d\n",
+				__func__, r);
+	}
+
+	r = usb_submit_urb(urb, GFP_KERNEL);
+	if (r) {
+		ch340_stats_inc(priv, &priv->stats.int_resubmit_failed);
+		if (r == -EPERM || r == -ENODEV)
+			return;
+		dev_err_ratelimited(&port->dev, "%s - usb_submit_urb failed: %d\n",
+				    __func__, r);
+		ch340_int_backoff(port, r);
+	}
+}
+
+/*
+ * The last known modem status, read on demand while the urb is parked or
+ * has been given up on.
+ */
+static u8 ch340_get_msr(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int r;
+
+	if (!READ_ONCE(priv->int_running) ||
+	    test_bit(CH340_INT_DEGRADED, &priv->flags)) {
+		r = ch340_pm_get(port);
+		if (!r) {
+			r = ch340_get_status(port->serial->dev, priv);
+			ch340_pm_put(port);
+		}
+		if (r < 0)
+			dev_dbg(&port->dev, "%s - status read failed: %d\n",
+				__func__, r);
+	}
+
+	return atomic_read(&priv->msr);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Queue the writes that bring a chip fresh from reset to the cached line
+ * settings. The chip reverts to its defaults, so the shadow is forgotten
+ * first.
+ */
+static void ch340_batch_restore(struct usb_device *dev,
+				struct ch340_private *priv,
+				struct ch340_ctrl_batch *batch,
+				unsigned int *actual)
+{
+	u16 reg;
+
+	ch340_invalidate_shadow(priv);
+
+	ch340_batch_control(priv, batch, CH340_REQ_SERIAL_INIT, 0, 0, NULL, 0);
+	ch340_batch_baudrate_lcr(dev, priv, batch, priv->lcr, &reg, actual);
+	if (priv->crtscts) {
+		ch340_batch_write_reg(priv, batch, CH340_FLOW_REG,
+				      CH340_FLOW_RTSCTS);
+	}
+	ch340_batch_set_handshake(priv, batch);
+}
+
+/*
+ * The whole sequence is queued before waiting, so the requests go out
+ * back to back instead of each waiting for the previous one's caller.
+ */
+static int ch340_configure(struct usb_device *dev, struct ch340_private *priv)
+{
+	struct ch340_ctrl_batch batch;
+	unsigned int actual = 0;
+	u8 buffer[2];
+	int r;
+
+	ch340_batch_init(&batch);
+
+	/* expect two bytes 0x27 0x00 */
+	ch340_batch_control(priv, &batch, CH340_REQ_READ_VERSION, 0, 0,
+			    buffer, sizeof(buffer));
+	ch340_batch_restore(dev, priv, &batch, &actual);
+
+	r = ch340_batch_wait(priv, &batch);
+	if (r < 0)
+		return r;
+
+	dev_dbg(&dev->dev, "Chip version: 0x%02x\n", buffer[0]);
+	priv->version = buffer[0];
+	priv->baud_actual = actual;
+	WRITE_ONCE(priv->tx_char_ns, ch340_char_ns(actual, priv->lcr));
+
+	return 0;
+}
+
+/*
+ * Work out the quirks of the chip once it has been configured, and fix the
+ * settings that depend on them. Reading the break register also seeds its
+ * shadow, so break changes are single writes from the start.
+ */
+static int ch340_detect_quirks(struct usb_serial_port *port,
+			       struct ch340_private *priv)
+{
+	struct usb_device *dev = port->serial->dev;
+	u8 buf[2];
+	int r;
+
+	if (priv->version <= priv->chip->buffering_inverted_max)
+		priv->quirks |= CH340_QUIRK_BUFFERING_INVERTED;
+
+	r = ch340_read_reg(dev, priv, CH340_BREAK_REG, buf);
+	if (r == -EPIPE) {
+		dev_info(&port->dev, "break control not supported\n");
+		priv->quirks |= CH340_QUIRK_LIMITED_PRESCALER |
+				CH340_QUIRK_NO_BREAK;
+	} else if (r < 0) {
+		return r;
+	}
+
+	dev_dbg(&port->dev, "%s - version 0x%02x, quirks 0x%lx\n", __func__,
+		priv->version, priv->quirks);
+
+	if (!priv->quirks)
+		return 0;
+
+	/* only the writes that change anything go out */
+	return ch340_set_baudrate_lcr(dev, priv, priv->lcr);
+}
+
+static unsigned int ch340_clamp_rx_urbs(unsigned int count)
+{
+	return clamp_t(unsigned int, count, 1, CH340_RX_URBS_MAX);
+}
+
+static unsigned int ch340_clamp_rx_buf_size(unsigned int size)
+{
+	return clamp_t(unsigned int, size, 1, CH340_RX_BUF_SIZE_MAX);
+}
+
+static unsigned int ch340_clamp_tx_urbs(unsigned int count)
+{
+	return clamp_t(unsigned int, count, 1, CH340_TX_URBS_MAX);
+}
+
+static unsigned int ch340_clamp_tx_buf_size(unsigned int size)
+{
+	return clamp_t(unsigned int, size, 1, CH340_TX_BUF_SIZE_MAX);
+}
+
+static int ch340_rx_submit(struct usb_serial_port *port, int index,
+			   gfp_t mem_flags)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int r;
+
+	if (!test_and_clear_bit(index, &priv->rx_urbs_free))
+		return 0;
+
+	if (trace_ch340_read_bulk_enabled())
+		priv->rx_submitted[index] = ktime_get();
+
+	r = usb_submit_urb(priv->rx_urbs[index], mem_flags);
+	if (r) {
+		ch340_stats_inc(priv, &priv->stats.rx_resubmit_failed);
+		if (r != -EPERM && r != -ENODEV) {
+			dev_err(&port->dev, "%s - usb_submit_urb failed: %d\n",
+				__func__, r);
+		}
+		set_bit(index, &priv->rx_urbs_free);
+		return r;
+	}
+
+	return 0;
+}
+
+static int ch340_rx_submit_all(struct usb_serial_port *port, gfp_t mem_flags)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int r;
+	int i;
+
+	for (i = 0; i < priv->rx_urbs_active; ++i) {
+		r = ch340_rx_submit(port, i, mem_flags);
+		if (r)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	for (; i >= 0; --i)
+		usb_kill_urb(priv->rx_urbs[i]);
+
+	return r;
+}
+
+static void ch340_rx_kill(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int i;
+
+	for (i = 0; i < priv->rx_urbs_active; ++i)
+		usb_kill_urb(priv->rx_urbs[i]);
+}
+
+/*
+ * Most urbs arrive with no line error pending and go to the tty in one
+ * go. The interrupt endpoint does not say which byte was in error, so
+ * when one is pending the whole urb is flagged, as pl2303 does.
+ */
+static void ch340_process_read_urb(struct urb *urb)
+{
+	struct usb_serial_port *port = urb->context;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned char *data = urb->transfer_buffer;
+	char tty_flag = TTY_NORMAL;
+	u8 lsr = 0;
+	int i;
+
+	if (!urb->actual_length)
+		return;
+
+	/* only pay for the exchange when an error is pending */
+	if (unlikely(atomic_read(&priv->lsr)))
+		lsr = atomic_xchg(&priv->lsr, 0);
+
+	if (unlikely(lsr)) {
+		if (lsr & CH340_LSR_PARITY)
+			tty_flag = TTY_PARITY;
+		else if (lsr & CH340_LSR_FRAME)
+			tty_flag = TTY_FRAME;
+
+		if (lsr & CH340_LSR_OVERRUN)
+			tty_insert_flip_char(&port->port, 0, TTY_OVERRUN);
+	}
+
+	if (port->port.console && port->sysrq) {
+		for (i = 0; i < urb->actual_length; ++i) {
+			if (!usb_serial_handle_sysrq_char(port, data[i]))
+				tty_insert_flip_char(&port->port, data[i],
+						     tty_flag);
+		}
+	} else if (tty_flag == TTY_NORMAL) {
+		tty_insert_flip_string(&port->port, data, urb->actual_length);
+	} else {
+		tty_insert_flip_string_fixed_flag(&port->port, data, tty_flag,
+						  urb->actual_length);
+	}
+
+	tty_flip_buffer_push(&port->port);
+}
+
+/*
+ * Take data from the write fifo and account for it in the same critical
+ * section, rather than locking the port again once the urb is filled.
+ */
+static int ch340_prepare_write_buffer(struct usb_serial_port *port,
+				      void *dest, size_t size)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	int count;
+
+	spin_lock_irqsave(&port->lock, flags);
+	count = kfifo_out(&port->write_fifo, dest, size);
+	port->tx_bytes += count;
+	priv->tx_urbs_sent++;
+	priv->tx_packets += DIV_ROUND_UP(count, priv->tx_maxp);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return count;
+}
+
+static void ch340_read_bulk_callback(struct urb *urb)
+{
+	struct usb_serial_port *port = urb->context;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned char *data = urb->transfer_buffer;
+	int status = urb->status;
+	ktime_t start = 0;
+	int i;
+
+	if (histograms)
+		start = ktime_get();
+
+	for (i = 0; i < priv->rx_urbs_active; ++i) {
+		if (urb == priv->rx_urbs[i])
+			break;
+	}
+
+	dev_dbg(&port->dev, "%s - urb %d, len %d\n", __func__, i,
+		urb->actual_length);
+
+	ch340_stats_urb(priv, CH340_PIPE_RX, status, urb->actual_length);
+
+	if (trace_ch340_read_bulk_enabled()) {
+		trace_ch340_read_bulk(&port->dev, i, urb->actual_length, status,
+				      ktime_to_ns(ktime_sub(ktime_get(),
+						  priv->rx_submitted[i])));
+	}
+
+	switch (status) {
+	case 0:
+		usb_serial_debug_data(&port->dev, __func__,
+				      urb->actual_length, data);
+		port->serial->type->process_read_urb(urb);
+		if (start)
+			ch340_hist_rx(priv, start);
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		dev_dbg(&port->dev, "%s - urb stopped: %d\n", __func__, status);
+		break;
+	case -EPIPE:
+		dev_err(&port->dev, "%s - urb stopped: %d\n", __func__, status);
+		break;
+	default:
+		dev_dbg(&port->dev, "%s - nonzero urb status: %d\n",
+			__func__, status);
+		status = 0;
+		break;
+	}
+
+	/*
+	 * Make sure the urb is processed before it is marked as free, and
+	 * marked as free before the throttle flag is tested, so that an
+	 * unthrottle on another CPU cannot miss it.
+	 */
+	smp_mb__before_atomic();
+	set_bit(i, &priv->rx_urbs_free);
+	smp_mb__after_atomic();
+
+	if (status)
+		return;
+
+	if (test_bit(CH340_RX_THROTTLED, &priv->flags))
+		return;
+
+	ch340_rx_submit(port, i, GFP_ATOMIC);
+}
+
+static void ch340_rx_free(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int i;
+
+	for (i = 0; i < priv->rx_urbs_active; ++i) {
+		usb_free_urb(priv->rx_urbs[i]);
+		priv->rx_urbs[i] = NULL;
+	}
+
+	priv->rx_urbs_active = 0;
+	priv->rx_urbs_free = 0;
+}
+
+/*
+ * Allocate the bulk-in read ring. The ring is sized from the per-port
+ * settings at every open so that sysfs changes take effect on the next
+ * open without disturbing a running port.
+ */
+static int ch340_rx_alloc(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct usb_device *dev = port->serial->dev;
+	unsigned int pipe, maxp, size;
+	struct urb *urb;
+	void *buf;
+	int i;
+
+	pipe = usb_rcvbulkpipe(dev, port->bulk_in_endpointAddress);
+	maxp = usb_maxpacket(dev, pipe, 0);
+	size = roundup(priv->rx_buf_size, maxp ? maxp : 1);
+
+	for (i = 0; i < priv->rx_urb_count; ++i) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			goto err;
+
+		buf = kmalloc(size, GFP_KERNEL);
+		if (!buf) {
+			usb_free_urb(urb);
+			goto err;
+		}
+
+		usb_fill_bulk_urb(urb, dev, pipe, buf, size,
+				  ch340_read_bulk_callback, port);
+		urb->transfer_flags |= URB_FREE_BUFFER;
+
+		priv->rx_urbs[i] = urb;
+		priv->rx_urbs_active = i + 1;
+		set_bit(i, &priv->rx_urbs_free);
+	}
+
+	dev_dbg(&port->dev, "%s - %u urbs of %u bytes\n", __func__,
+		priv->rx_urbs_active, size);
+
+	return 0;
+
+err:
+	ch340_rx_free(port);
+	return -ENOMEM;
+}
+
+static void ch340_throttle(struct tty_struct *tty)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	set_bit(CH340_RX_THROTTLED, &priv->flags);
+}
+
+static void ch340_unthrottle(struct tty_struct *tty)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	clear_bit(CH340_RX_THROTTLED, &priv->flags);
+
+	/*
+	 * Matches the smp_mb__after_atomic() in ch340_read_bulk_callback()
+	 * so that urbs completed while throttled are resubmitted here.
+	 */
+	smp_mb();
+
+	ch340_rx_submit_all(port, GFP_KERNEL);
+}
+
+/*
+ * Switch RTS to the RS485 send level, waiting until the chip has done it so
+ * that the turnaround delay counts from the real change.
+ */
+static int ch340_rs485_set_rts(struct ch340_private *priv, bool on)
+{
+	if (on)
+		ch340_update_mcr(priv, CH340_BIT_RTS, 0);
+	else
+		ch340_update_mcr(priv, 0, CH340_BIT_RTS);
+
+	return ch340_set_handshake_wait(priv);
+}
+
+/*
+ * Whether data may be sent in RS485 mode now; otherwise it waits for RTS
+ * to reach the send level. Called with port->lock held.
+ */
+static bool ch340_rs485_start(struct ch340_private *priv)
+{
+	switch (priv->rs485_state) {
+	case CH340_RS485_IDLE:
+		priv->rs485_state = CH340_RS485_ASSERTING;
+		schedule_work(&priv->rs485_work);
+		return false;
+	case CH340_RS485_DRAINING:
+		/* RTS is still at the send level, keep it there */
+		hrtimer_try_to_cancel(&priv->rs485_timer);
+		priv->rs485_state = CH340_RS485_SENDING;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static enum hrtimer_restart ch340_rs485_timer(struct hrtimer *timer)
+{
+	struct ch340_private *priv = container_of(timer, struct ch340_private,
+						  rs485_timer);
+	struct usb_serial_port *port = priv->port;
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->lock, flags);
+	if (priv->rs485_state == CH340_RS485_DRAINING) {
+		priv->rs485_state = CH340_RS485_RELEASING;
+		schedule_work(&priv->rs485_work);
+	}
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static int ch340_write_start(struct usb_serial_port *port, gfp_t mem_flags)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	struct urb *urb;
+	unsigned int len;
+	size_t size;
+	int count;
+	int r;
+	int i;
+
+retry:
+	if (test_and_set_bit_lock(CH340_TX_BUSY, &priv->flags))
+		return 0;
+
+	spin_lock_irqsave(&port->lock, flags);
+	len = kfifo_len(&port->write_fifo);
+	if (!priv->tx_urbs_free || !len)
+		goto out_unlock;
+
+	/*
+	 * Keep the device awake until the queue has drained; while it is
+	 * resuming the data waits in the fifo for ch340_resume_io().
+	 */
+	if (!priv->tx_pm &&
+	    usb_autopm_get_interface_async(port->serial->interface) == 0)
+		priv->tx_pm = true;
+	if (priv->suspended)
+		goto out_unlock;
+
+	if ((priv->rs485.flags & SER_RS485_ENABLED) &&
+	    priv->rs485_state != CH340_RS485_SENDING &&
+	    !ch340_rs485_start(priv))
+		goto out_unlock;
+
+	size = priv->tx_urb_size;
+	if (priv->tx_urbs_free != priv->tx_urbs_mask) {
+		/*
+		 * While other urbs are in flight, only send whole packets and
+		 * leave any tail in the fifo to be merged with later writes;
+		 * the next completion restarts the queue.
+		 */
+		if (len < priv->tx_maxp) {
+			priv->tx_deferred++;
+			goto out_unlock;
+		}
+		if (len < size)
+			size = rounddown(len, priv->tx_maxp);
+	}
+
+	i = __ffs(priv->tx_urbs_free);
+	priv->tx_urbs_free &= ~BIT(i);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	urb = priv->tx_urbs[i];
+	count = port->serial->type->prepare_write_buffer(port,
+						urb->transfer_buffer, size);
+	urb->transfer_buffer_length = count;
+	usb_serial_debug_data(&port->dev, __func__, count,
+			      urb->transfer_buffer);
+
+	if (trace_ch340_write_bulk_enabled())
+		priv->tx_submitted[i] = ktime_get();
+
+	r = usb_submit_urb(urb, mem_flags);
+	if (r) {
+		dev_err_console(port, "%s - error submitting urb: %d\n",
+				__func__, r);
+		spin_lock_irqsave(&port->lock, flags);
+		port->tx_bytes -= count;
+		priv->tx_urbs_free |= BIT(i);
+		spin_unlock_irqrestore(&port->lock, flags);
+		clear_bit_unlock(CH340_TX_BUSY, &priv->flags);
+		return r;
+	}
+
+	clear_bit_unlock(CH340_TX_BUSY, &priv->flags);
+	goto retry;	/* try sending off another urb */
+
+out_unlock:
+	clear_bit_unlock(CH340_TX_BUSY, &priv->flags);
+	spin_unlock_irqrestore(&port->lock, flags);
+	return 0;
+}
+
+static void ch340_rs485_work(struct work_struct *work)
+{
+	struct ch340_private *priv = container_of(work, struct ch340_private,
+						  rs485_work);
+	struct usb_serial_port *port = priv->port;
+	enum ch340_rs485_state state;
+	struct serial_rs485 rs485;
+	unsigned long flags;
+	unsigned int delay;
+	int r;
+
+	spin_lock_irqsave(&port->lock, flags);
+	state = priv->rs485_state;
+	rs485 = priv->rs485;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (state != CH340_RS485_ASSERTING && state != CH340_RS485_RELEASING)
+		return;
+
+	r = ch340_pm_get(port);
+	if (r) {
+		dev_dbg(&port->dev, "%s - failed to resume: %d\n", __func__, r);
+		return;
+	}
+
+	switch (state) {
+	case CH340_RS485_ASSERTING:
+		r = ch340_rs485_set_rts(priv,
+					rs485.flags & SER_RS485_RTS_ON_SEND);
+		if (r)
+			dev_dbg(&port->dev, "%s - failed to raise RTS: %d\n",
+				__func__, r);
+
+		delay = rs485.delay_rts_before_send * USEC_PER_MSEC;
+		if (delay)
+			usleep_range(delay, delay + 50);
+
+		spin_lock_irqsave(&port->lock, flags);
+		if (priv->rs485_state == CH340_RS485_ASSERTING)
+			priv->rs485_state = CH340_RS485_SENDING;
+		spin_unlock_irqrestore(&port->lock, flags);
+		break;
+	case CH340_RS485_RELEASING:
+		r = ch340_rs485_set_rts(priv,
+					rs485.flags & SER_RS485_RTS_AFTER_SEND);
+		if (r)
+			dev_dbg(&port->dev, "%s - failed to release RTS: %d\n",
+				__func__, r);
+
+		spin_lock_irqsave(&port->lock, flags);
+		if (priv->rs485_state == CH340_RS485_RELEASING)
+			priv->rs485_state = CH340_RS485_IDLE;
+		spin_unlock_irqrestore(&port->lock, flags);
+		break;
+	default:
+		break;
+	}
+
+	ch340_pm_put(port);
+
+	/* send what was written meanwhile, turning RTS around again */
+	ch340_write_start(port, GFP_KERNEL);
+}
+
+static int ch340_write(struct tty_struct *tty, struct usb_serial_port *port,
+		       const unsigned char *buf, int count)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	int r;
+
+	if (!count)
+		return 0;
+
+	spin_lock_irqsave(&port->lock, flags);
+	count = kfifo_in(&port->write_fifo, buf, count);
+	priv->tx_writes++;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	r = ch340_write_start(port, GFP_ATOMIC);
+	if (r)
+		return r;
+
+	return count;
+}
+
+/*
+ * Bytes accepted by the chip but not yet sent, estimated from when it
+ * should go idle. Called with port->lock held.
+ */
+static unsigned int ch340_tx_chip_bytes(struct ch340_private *priv)
+{
+	unsigned int char_ns = READ_ONCE(priv->tx_char_ns);
+	ktime_t now = ktime_get();
+
+	if (!char_ns || !ktime_after(priv->tx_idle, now))
+		return 0;
+
+	return DIV_ROUND_UP_ULL(ktime_to_ns(ktime_sub(priv->tx_idle, now)),
+				char_ns);
+}
+
+/*
+ * Account for len bytes handed to the chip. They go out after whatever it
+ * already holds, but the chip never holds more than its buffer. Called
+ * with port->lock held; returns the time the chip should go idle.
+ */
+static ktime_t ch340_tx_chip_add(struct ch340_private *priv, unsigned int len)
+{
+	unsigned int char_ns = READ_ONCE(priv->tx_char_ns);
+	ktime_t now = ktime_get();
+	ktime_t idle, max;
+
+	idle = ktime_after(priv->tx_idle, now) ? priv->tx_idle : now;
+	idle = ktime_add_ns(idle, (u64)len * char_ns);
+	max = ktime_add_ns(now, (u64)priv->chip->fifo_size * char_ns);
+	if (ktime_after(idle, max))
+		idle = max;
+
+	priv->tx_idle = idle;
+
+	return idle;
+}
+
+/* Wake up writers and tcdrain() once the chip should have gone idle. */
+static enum hrtimer_restart ch340_tx_idle_timer(struct hrtimer *timer)
+{
+	struct ch340_private *priv = container_of(timer, struct ch340_private,
+						  tx_idle_timer);
+
+	usb_serial_port_softint(priv->port);
+
+	return HRTIMER_NORESTART;
+}
+
+static int ch340_chars_in_buffer(struct tty_struct *tty)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	int chars;
+
+	spin_lock_irqsave(&port->lock, flags);
+	chars = kfifo_len(&port->write_fifo) + port->tx_bytes +
+		ch340_tx_chip_bytes(priv);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	dev_dbg(&port->dev, "%s - %d\n", __func__, chars);
+
+	return chars;
+}
+
+static bool ch340_tx_empty(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	bool empty;
+
+	spin_lock_irqsave(&port->lock, flags);
+	empty = !kfifo_len(&port->write_fifo) && !port->tx_bytes &&
+		!ch340_tx_chip_bytes(priv);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return empty;
+}
+
+static void ch340_write_bulk_callback(struct urb *urb)
+{
+	struct usb_serial_port *port = urb->context;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int status = urb->status;
+	unsigned long flags;
+	bool drained;
+	bool stopped;
+	bool pm_put = false;
+	ktime_t idle;
+	int i;
+
+	for (i = 0; i < priv->tx_urbs_active; ++i) {
+		if (urb == priv->tx_urbs[i])
+			break;
+	}
+
+	stopped = status == -ENOENT || status == -ECONNRESET ||
+		  status == -ESHUTDOWN;
+
+	spin_lock_irqsave(&port->lock, flags);
+	port->tx_bytes -= urb->transfer_buffer_length;
+	priv->tx_urbs_free |= BIT(i);
+	idle = ch340_tx_chip_add(priv, urb->actual_length);
+	drained = !port->tx_bytes && !kfifo_len(&port->write_fifo);
+	/* a killed urb must not switch RTS on a port being closed */
+	if (drained && !stopped &&
+	    priv->rs485_state == CH340_RS485_SENDING) {
+		priv->rs485_state = CH340_RS485_DRAINING;
+		hrtimer_start(&priv->rs485_timer,
+			      ktime_add_ms(idle, priv->rs485.delay_rts_after_send),
+			      HRTIMER_MODE_ABS);
+	}
+	if (drained && priv->tx_pm) {
+		priv->tx_pm = false;
+		pm_put = true;
+	}
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (pm_put) {
+		usb_mark_last_busy(port->serial->dev);
+		usb_autopm_put_interface_async(port->serial->interface);
+	}
+
+	/* nothing else will complete to report the line going idle */
+	if (drained && urb->actual_length)
+		hrtimer_start(&priv->tx_idle_timer, idle, HRTIMER_MODE_ABS);
+
+	ch340_stats_urb(priv, CH340_PIPE_TX, status, urb->actual_length);
+
+	if (trace_ch340_write_bulk_enabled()) {
+		trace_ch340_write_bulk(&port->dev, i, urb->actual_length, status,
+				       ktime_to_ns(ktime_sub(ktime_get(),
+						   priv->tx_submitted[i])));
+	}
+
+	switch (status) {
+	case 0:
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		dev_dbg(&port->dev, "%s - urb stopped: %d\n", __func__, status);
+		return;
+	case -EPIPE:
+		dev_err_console(port, "%s - urb stopped: %d\n", __func__,
+				status);
+		return;
+	default:
+		dev_err_console(port, "%s - nonzero urb status: %d\n",
+				__func__, status);
+		break;
+	}
+
+	ch340_write_start(port, GFP_ATOMIC);
+	usb_serial_port_softint(port);
+}
+
+static void ch340_tx_kill(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int i;
+
+	for (i = 0; i < priv->tx_urbs_active; ++i)
+		usb_kill_urb(priv->tx_urbs[i]);
+}
+
+static void ch340_tx_free(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int i;
+
+	for (i = 0; i < priv->tx_urbs_active; ++i) {
+		usb_free_urb(priv->tx_urbs[i]);
+		priv->tx_urbs[i] = NULL;
+	}
+
+	priv->tx_urbs_active = 0;
+	priv->tx_urbs_free = 0;
+	priv->tx_urbs_mask = 0;
+}
+
+static int ch340_tx_alloc(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct usb_device *dev = port->serial->dev;
+	unsigned int pipe, maxp, size;
+	struct urb *urb;
+	void *buf;
+	int i;
+
+	pipe = usb_sndbulkpipe(dev, port->bulk_out_endpointAddress);
+	maxp = usb_maxpacket(dev, pipe, 1);
+	priv->tx_maxp = maxp ? maxp : 1;
+	size = roundup(priv->tx_buf_size, priv->tx_maxp);
+
+	for (i = 0; i < priv->tx_urb_count; ++i) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!urb)
+			goto err;
+
+		buf = kmalloc(size, GFP_KERNEL);
+		if (!buf) {
+			usb_free_urb(urb);
+			goto err;
+		}
+
+		usb_fill_bulk_urb(urb, dev, pipe, buf, size,
+				  ch340_write_bulk_callback, port);
+		urb->transfer_flags |= URB_FREE_BUFFER;
+
+		priv->tx_urbs[i] = urb;
+		priv->tx_urbs_active = i + 1;
+	}
+
+	priv->tx_urb_size = size;
+	priv->tx_urbs_mask = BIT(priv->tx_urbs_active) - 1;
+	priv->tx_urbs_free = priv->tx_urbs_mask;
+
+	dev_dbg(&port->dev, "%s - %u urbs of %u bytes\n", __func__,
+		priv->tx_urbs_active, size);
+
+	return 0;
+
+err:
+	ch340_tx_free(port);
+	return -ENOMEM;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static ssize_t rx_urbs_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%u\n", priv->rx_urb_count);
+}
+
+static ssize_t rx_urbs_store(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val || val > CH340_RX_URBS_MAX)
+		return -EINVAL;
+
+	priv->rx_urb_count = val;
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_urbs);
+
+static ssize_t rx_buf_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%u\n", priv->rx_buf_size);
+}
+
+static ssize_t rx_buf_size_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val || val > CH340_RX_BUF_SIZE_MAX)
+		return -EINVAL;
+
+	priv->rx_buf_size = val;
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_buf_size);
+
+static ssize_t tx_urbs_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%u\n", priv->tx_urb_count);
+}
+
+static ssize_t tx_urbs_store(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val || val > CH340_TX_URBS_MAX)
+		return -EINVAL;
+
+	priv->tx_urb_count = val;
+
+	return count;
+}
+static DEVICE_ATTR_RW(tx_urbs);
+
+static ssize_t tx_buf_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%u\n", priv->tx_buf_size);
+}
+
+static ssize_t tx_buf_size_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val || val > CH340_TX_BUF_SIZE_MAX)
+		return -EINVAL;
+
+	priv->tx_buf_size = val;
+
+	return count;
+}
+static DEVICE_ATTR_RW(tx_buf_size);
+
+/*
+ * Write coalescing counters: tty writes, urbs and packets actually sent,
+ * and how often a short tail was held back to be merged.
+ */
+static ssize_t tx_coalescing_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long writes, urbs, packets, deferred;
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->lock, flags);
+	writes = priv->tx_writes;
+	urbs = priv->tx_urbs_sent;
+	packets = priv->tx_packets;
+	deferred = priv->tx_deferred;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	return sprintf(buf, "writes %lu urbs %lu packets %lu deferred %lu\n",
+		       writes, urbs, packets, deferred);
+}
+static DEVICE_ATTR_RO(tx_coalescing);
+
+static ssize_t baud_actual_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%u\n", priv->baud_actual);
+}
+static DEVICE_ATTR_RO(baud_actual);
+
+static ssize_t baud_error_ppm_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_baud_entry set;
+
+	/* priv->baud_rate is only kept once the chip has taken it */
+	if (!ch340_calc_baud(priv->baud_rate,
+			     priv->quirks & CH340_QUIRK_LIMITED_PRESCALER, &set))
+		return sprintf(buf, "0\n");
+
+	return sprintf(buf, "%d\n", ch340_baud_error_ppm(&set));
+}
+static DEVICE_ATTR_RO(baud_error_ppm);
+
+static int ch340_set_rx_mode(struct usb_serial_port *port,
+			     enum ch340_rx_mode mode)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	enum ch340_rx_mode old;
+	int r;
+
+	r = ch340_pm_get(port);
+	if (r)
+		return r;
+
+	mutex_lock(&priv->line_mutex);
+	old = priv->rx_mode;
+	if (old != mode) {
+		priv->rx_mode = mode;
+		/* only the 0x1312 write goes out, the LCR is still shadowed */
+		r = ch340_set_baudrate_lcr(port->serial->dev, priv, priv->lcr);
+		if (r)
+			priv->rx_mode = old;
+	}
+	mutex_unlock(&priv->line_mutex);
+	ch340_pm_put(port);
+
+	return r;
+}
+
+static ssize_t rx_mode_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%s\n", ch340_rx_mode_names[priv->rx_mode]);
+}
+
+static ssize_t rx_mode_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	int mode;
+	int r;
+
+	for (mode = 0; mode < ARRAY_SIZE(ch340_rx_mode_names); ++mode) {
+		if (sysfs_streq(buf, ch340_rx_mode_names[mode]))
+			break;
+	}
+	if (mode == ARRAY_SIZE(ch340_rx_mode_names))
+		return -EINVAL;
+
+	r = ch340_set_rx_mode(port, mode);
+	if (r)
+		return r;
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_mode);
+
+/*
+ * Polling period of the interrupt endpoint, which bounds the delay from a
+ * modem line edge to its PPS timestamp.
+ */
+static ssize_t int_interval_us_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	unsigned int interval = port->interrupt_in_urb->interval;
+
+	if (port->serial->dev->speed >= USB_SPEED_HIGH)
+		interval *= 125;
+	else
+		interval *= 1000;
+
+	return sprintf(buf, "%u\n", interval);
+}
+static DEVICE_ATTR_RO(int_interval_us);
+
+static ssize_t int_park_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%d\n", priv->int_park);
+}
+
+static ssize_t int_park_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	bool val;
+	int r;
+
+	r = kstrtobool(buf, &val);
+	if (r)
+		return r;
+
+	mutex_lock(&priv->int_mutex);
+	priv->int_park = val;
+	r = ch340_int_update(port);
+	mutex_unlock(&priv->int_mutex);
+	if (r)
+		return r;
+
+	return count;
+}
+static DEVICE_ATTR_RW(int_park);
+
+/* whether the interrupt urb is running, for checking when it is parked */
+static ssize_t int_running_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%d\n", READ_ONCE(priv->int_running));
+}
+static DEVICE_ATTR_RO(int_running);
+
+/* whether the interrupt urb was given up on after repeated errors */
+static ssize_t int_degraded_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%d\n",
+		       test_bit(CH340_INT_DEGRADED, &priv->flags));
+}
+static DEVICE_ATTR_RO(int_degraded);
+
+static ssize_t version_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "0x%02x\n", priv->version);
+}
+static DEVICE_ATTR_RO(version);
+
+static ssize_t quirks_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "0x%lx\n", priv->quirks);
+}
+static DEVICE_ATTR_RO(quirks);
+
+static ssize_t chip_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	return sprintf(buf, "%s\n", priv->chip->name);
+}
+static DEVICE_ATTR_RO(chip);
+
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_stats stats;
+	u64 rx_errors = 0, tx_errors = 0;
+	int i;
+
+	ch340_stats_read(priv, &stats);
+	for (i = 0; i < CH340_ERR_STOPPED; ++i) {
+		rx_errors += stats.rx_errors[i];
+		tx_errors += stats.tx_errors[i];
+	}
+	rx_errors += stats.rx_errors[CH340_ERR_OTHER];
+	tx_errors += stats.tx_errors[CH340_ERR_OTHER];
+
+	return sprintf(buf, "rx_bytes %llu tx_bytes %llu rx_errors %llu tx_errors %llu ctrl %llu ctrl_errors %llu\n",
+		       stats.rx_bytes, stats.tx_bytes, rx_errors, tx_errors,
+		       stats.ctrl_requests, stats.ctrl_errors);
+}
+static DEVICE_ATTR_RO(stats);
+
+struct ch340_mcr_step {
+	u8 mcr;
+	unsigned int delay;	/* microseconds */
+};
+
+/*
+ * Parse a sequence of "<lines>[:<delay>]" steps separated by white space,
+ * where lines is a TIOCM_DTR | TIOCM_RTS mask and delay the time in
+ * microseconds to hold them before the next step.
+ */
+static int ch340_parse_mcr_seq(const char *buf, struct ch340_mcr_step *steps)
+{
+	unsigned int lines, delay;
+	int count = 0;
+	int n;
+
+	for (;;) {
+		buf = skip_spaces(buf);
+		if (!*buf)
+			break;
+		if (count == CH340_MCR_SEQ_MAX)
+			return -E2BIG;
+
+		if (sscanf(buf, "%i%n", &lines, &n) != 1)
+			return -EINVAL;
+		buf += n;
+
+		delay = 0;
+		if (*buf == ':') {
+			if (sscanf(buf + 1, "%u%n", &delay, &n) != 1)
+				return -EINVAL;
+			buf += 1 + n;
+		}
+
+		if (*buf && !isspace(*buf))
+			return -EINVAL;
+		if (lines & ~(TIOCM_DTR | TIOCM_RTS))
+			return -EINVAL;
+		if (delay > CH340_MCR_SEQ_DELAY_MAX_US)
+			return -EINVAL;
+
+		steps[count].mcr = 0;
+		if (lines & TIOCM_DTR)
+			steps[count].mcr |= CH340_BIT_DTR;
+		if (lines & TIOCM_RTS)
+			steps[count].mcr |= CH340_BIT_RTS;
+		steps[count].delay = delay;
+		count++;
+	}
+
+	return count ? count : -EINVAL;
+}
+
+/*
+ * Run a modem control sequence, such as a board reset into its bootloader,
+ * back to back in the driver. Each delay counts from the chip having
+ * changed the lines.
+ */
+static ssize_t mcr_sequence_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct usb_serial_port *port = to_usb_serial_port(dev);
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_mcr_step steps[CH340_MCR_SEQ_MAX];
+	int n, i;
+	int r;
+
+	n = ch340_parse_mcr_seq(buf, steps);
+	if (n < 0)
+		return n;
+
+	r = mutex_lock_interruptible(&priv->mcr_seq_mutex);
+	if (r)
+		return r;
+
+	/*
+	 * With CRTSCTS or RS485 on, RTS belongs to the chip or to direction
+	 * control; line_mutex keeps either from starting mid-sequence.
+	 */
+	r = mutex_lock_interruptible(&priv->line_mutex);
+	if (r)
+		goto out_unlock_seq;
+
+	if (priv->crtscts ||
+	    (READ_ONCE(priv->rs485.flags) & SER_RS485_ENABLED)) {
+		r = -EBUSY;
+		goto out_unlock_line;
+	}
+
+	r = ch340_pm_get(port);
+	if (r)
+		goto out_unlock_line;
+
+	for (i = 0; i < n; ++i) {
+		ch340_update_mcr(priv, steps[i].mcr,
+				 ~steps[i].mcr & (CH340_BIT_DTR | CH340_BIT_RTS));
+		r = ch340_set_handshake_wait(priv);
+		if (r < 0)
+			break;
+
+		if (!steps[i].delay)
+			continue;
+		if (steps[i].delay < 20000)
+			usleep_range(steps[i].delay, steps[i].delay + 50);
+		else
+			msleep(DIV_ROUND_UP(steps[i].delay, 1000));
+	}
+
+	ch340_pm_put(port);
+out_unlock_line:
+	mutex_unlock(&priv->line_mutex);
+out_unlock_seq:
+	mutex_unlock(&priv->mcr_seq_mutex);
+	if (r < 0)
+		return r;
+
+	return count;
+}
+static DEVICE_ATTR_WO(mcr_sequence);
+
+static struct attribute *ch340_attrs[] = {
+	&dev_attr_rx_urbs.attr,
+	&dev_attr_rx_buf_size.attr,
+	&dev_attr_tx_urbs.attr,
+	&dev_attr_tx_buf_size.attr,
+	&dev_attr_tx_coalescing.attr,
+	&dev_attr_baud_actual.attr,
+	&dev_attr_baud_error_ppm.attr,
+	&dev_attr_stats.attr,
+	&dev_attr_rx_mode.attr,
+	&dev_attr_int_interval_us.attr,
+	&dev_attr_int_park.attr,
+	&dev_attr_int_running.attr,
+	&dev_attr_int_degraded.attr,
+	&dev_attr_mcr_sequence.attr,
+	&dev_attr_version.attr,
+	&dev_attr_quirks.attr,
+	&dev_attr_chip.attr,
+	NULL
+};
+
+static const struct attribute_group ch340_attr_group = {
+	.attrs = ch340_attrs,
+};
+
+static void ch340_seq_errors(struct seq_file *s, const char *name,
+			     const u64 *errors)
+{
+	int i;
+
+	seq_printf(s, "%s:", name);
+	for (i = 0; i < CH340_ERR_MAX; ++i)
+		seq_printf(s, " %s %llu", ch340_err_names[i], errors[i]);
+	seq_putc(s, '\n');
+}
+
+static int ch340_stats_show(struct seq_file *s, void *unused)
+{
+	struct usb_serial_port *port = s->private;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long writes, urbs, packets, deferred;
+	struct ch340_stats stats;
+	u64 avg = 0;
 	unsigned long flags;
+	int i;
 
-	/* drop DTR and RTS */
-	spin_lock_irqsave(&priv->lock, flags);
-	if (on)
-		priv->mcr |= CH340_BIT_RTS | CH340_BIT_DTR;
+	ch340_stats_read(priv, &stats);
+
+	spin_lock_irqsave(&port->lock, flags);
+	writes = priv->tx_writes;
+	urbs = priv->tx_urbs_sent;
+	packets = priv->tx_packets;
+	deferred = priv->tx_deferred;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	seq_printf(s, "rx_bytes: %llu\n", stats.rx_bytes);
+	seq_printf(s, "rx_urbs: %llu\n", stats.rx_urbs);
+	seq_printf(s, "rx_resubmit_failed: %llu\n", stats.rx_resubmit_failed);
+	ch340_seq_errors(s, "rx_errors", stats.rx_errors);
+
+	seq_printf(s, "tx_bytes: %llu\n", stats.tx_bytes);
+	seq_printf(s, "tx_urbs: %llu\n", stats.tx_urbs);
+	ch340_seq_errors(s, "tx_errors", stats.tx_errors);
+	seq_printf(s, "tx_coalescing: writes %lu urbs %lu packets %lu deferred %lu\n",
+		   writes, urbs, packets, deferred);
+
+	seq_printf(s, "int_urbs: %llu\n", stats.int_urbs);
+	seq_printf(s, "int_resubmit_failed: %llu\n", stats.int_resubmit_failed);
+	seq_printf(s, "int_backoffs: %llu\n", stats.int_backoffs);
+	seq_printf(s, "int_degraded: %llu\n", stats.int_degraded);
+	ch340_seq_errors(s, "int_errors", stats.int_errors);
+	seq_printf(s, "modem_deltas: cts %llu dsr %llu rng %llu dcd %llu\n",
+		   stats.cts, stats.dsr, stats.rng, stats.dcd);
+	seq_printf(s, "line_errors: frame %llu parity %llu overrun %llu\n",
+		   stats.frame, stats.parity, stats.overrun);
+
+	seq_printf(s, "ctrl_requests: %llu\n", stats.ctrl_requests);
+	seq_puts(s, "ctrl_by_request:");
+	for (i = 0; i < CH340_CTRL_MAX; ++i)
+		seq_printf(s, " %s %llu", ch340_ctrl_names[i],
+			   stats.ctrl_by_request[i]);
+	seq_putc(s, '\n');
+	seq_printf(s, "ctrl_errors: %llu\n", stats.ctrl_errors);
+	seq_printf(s, "ctrl_skipped: %llu\n", stats.ctrl_skipped);
+	seq_printf(s, "ctrl_coalesced: %llu\n", stats.ctrl_coalesced);
+
+	if (stats.ctrl_completed)
+		avg = div64_u64(stats.ctrl_time_total, stats.ctrl_completed);
 	else
-		priv->mcr &= ~(CH340_BIT_RTS | CH340_BIT_DTR);
-	spin_unlock_irqrestore(&priv->lock, flags);
-	ch340_set_handshake(port->serial->dev, priv->mcr);
+		stats.ctrl_time_min = 0;
+	seq_printf(s, "ctrl_latency_ns: min %llu avg %llu max %llu\n",
+		   stats.ctrl_time_min, avg, stats.ctrl_time_max);
+
+	avg = 0;
+	if (stats.int_intervals)
+		avg = div64_u64(stats.int_interval_total, stats.int_intervals);
+	else
+		stats.int_interval_min = 0;
+	seq_printf(s, "int_interval_ns: min %llu avg %llu max %llu\n",
+		   stats.int_interval_min, avg, stats.int_interval_max);
+
+	seq_printf(s, "pm_suspends: %llu\n", stats.pm_suspends);
+	seq_printf(s, "pm_resumes: %llu\n", stats.pm_resumes);
+	avg = 0;
+	if (stats.pm_resumes)
+		avg = div64_u64(stats.pm_resume_time_total, stats.pm_resumes);
+	else
+		stats.pm_resume_time_min = 0;
+	seq_printf(s, "pm_resume_ns: min %llu avg %llu max %llu\n",
+		   stats.pm_resume_time_min, avg, stats.pm_resume_time_max);
+
+	return 0;
+}
+
+static int ch340_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ch340_stats_show, inode->i_private);
+}
+
+static const struct file_operations ch340_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ch340_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void ch340_seq_hist(struct seq_file *s, const char *name,
+			   const struct ch340_hist *hist)
+{
+	int i;
+
+	seq_printf(s, "%s:\n", name);
+	for (i = 0; i < CH340_HIST_BUCKETS; ++i) {
+		if (!hist->count[i])
+			continue;
+		if (i == CH340_HIST_BUCKETS - 1)
+			seq_printf(s, "  %llu+: %llu\n", 1ULL << (i - 1),
+				   hist->count[i]);
+		else
+			seq_printf(s, "  %llu-%llu: %llu\n",
+				   i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1,
+				   hist->count[i]);
+	}
+}
+
+static int ch340_histograms_show(struct seq_file *s, void *unused)
+{
+	struct usb_serial_port *port = s->private;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_hist hist;
+	unsigned long flags;
+	int i;
+
+	ch340_hist_read_rx(priv, &hist);
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	for (i = 0; i < CH340_HIST_BUCKETS; ++i)
+		hist.count[i] -= priv->rx_hist_base.count[i];
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
+	ch340_seq_hist(s, "rx_delivery_ns", &hist);
+
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	hist = priv->ctrl_hist;
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
+	ch340_seq_hist(s, "ctrl_ns", &hist);
+
+	return 0;
+}
+
+static int ch340_histograms_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ch340_histograms_show, inode->i_private);
+}
+
+/* any write clears both histograms */
+static ssize_t ch340_histograms_write(struct file *file,
+				      const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	struct usb_serial_port *port = file_inode(file)->i_private;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_hist base;
+	unsigned long flags;
+
+	ch340_hist_read_rx(priv, &base);
+	spin_lock_irqsave(&priv->stats_lock, flags);
+	priv->rx_hist_base = base;
+	memset(&priv->ctrl_hist, 0, sizeof(priv->ctrl_hist));
+	spin_unlock_irqrestore(&priv->stats_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations ch340_histograms_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ch340_histograms_open,
+	.read		= seq_read,
+	.write		= ch340_histograms_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void ch340_debugfs_init(struct usb_serial_port *port,
+			       struct ch340_private *priv)
+{
+	priv->debugfs = debugfs_create_dir(dev_name(&port->dev),
+					   ch340_debugfs_root);
+	debugfs_create_file("stats", 0444, priv->debugfs, port,
+			    &ch340_stats_fops);
+	debugfs_create_file("histograms", 0644, priv->debugfs, port,
+			    &ch340_histograms_fops);
+}
+
+#if IS_REACHABLE(CONFIG_PPS)
+static void ch340_pps_register(struct usb_serial_port *port,
+			       struct ch340_private *priv)
+{
+	struct pps_source_info info = {
+		.mode	= PPS_CAPTUREBOTH | PPS_OFFSETASSERT |
+			  PPS_OFFSETCLEAR | PPS_CANWAIT | PPS_TSFMT_TSPEC,
+		.owner	= THIS_MODULE,
+		.dev	= &port->dev,
+	};
+	struct pps_device *pps;
+
+	snprintf(info.name, PPS_MAX_NAME_LEN, "%s-%s", KBUILD_MODNAME,
+		 dev_name(&port->dev));
+	snprintf(info.path, PPS_MAX_NAME_LEN, "/dev/%s",
+		 dev_name(&port->dev));
+
+	pps = pps_register_source(&info, PPS_CAPTUREBOTH | PPS_OFFSETASSERT |
+					 PPS_OFFSETCLEAR);
+	if (IS_ERR_OR_NULL(pps)) {
+		dev_err(&port->dev, "failed to register PPS source\n");
+		return;
+	}
+
+	priv->pps = pps;
+}
+
+static void ch340_pps_unregister(struct ch340_private *priv)
+{
+	if (priv->pps)
+		pps_unregister_source(priv->pps);
+}
+
+static void ch340_pps_stamp(struct ch340_private *priv)
+{
+	if (priv->pps)
+		pps_get_ts(&priv->pps_ts);
+}
+
+static void ch340_pps_event(struct ch340_private *priv, bool assert)
+{
+	if (priv->pps) {
+		pps_event(priv->pps, &priv->pps_ts,
+			  assert ? PPS_CAPTUREASSERT : PPS_CAPTURECLEAR, NULL);
+	}
+}
+#else
+static void ch340_pps_register(struct usb_serial_port *port,
+			       struct ch340_private *priv)
+{
+	dev_warn(&port->dev, "PPS support is not available\n");
+}
+
+static void ch340_pps_unregister(struct ch340_private *priv) {}
+static void ch340_pps_stamp(struct ch340_private *priv) {}
+static void ch340_pps_event(struct ch340_private *priv, bool assert) {}
+#endif
+
+static void ch340_ctrl_free(struct ch340_private *priv)
+{
+	usb_kill_urb(priv->ctrl_urb);
+	usb_free_urb(priv->ctrl_urb);
+	kfree(priv->ctrl_setup);
+	kfree(priv->ctrl_buf);
+}
+
+static int ch340_ctrl_alloc(struct usb_serial_port *port,
+			    struct ch340_private *priv)
+{
+	struct usb_device *dev = port->serial->dev;
+
+	spin_lock_init(&priv->ctrl_lock);
+	init_waitqueue_head(&priv->ctrl_wait);
+
+	priv->ctrl_urb = usb_alloc_urb(0, GFP_KERNEL);
+	priv->ctrl_setup = kmalloc(sizeof(*priv->ctrl_setup), GFP_KERNEL);
+	priv->ctrl_buf = kmalloc(CH340_CTRL_BUF_SIZE, GFP_KERNEL);
+	if (!priv->ctrl_urb || !priv->ctrl_setup || !priv->ctrl_buf) {
+		ch340_ctrl_free(priv);
+		return -ENOMEM;
+	}
+
+	usb_fill_control_urb(priv->ctrl_urb, dev, usb_sndctrlpipe(dev, 0),
+			     (unsigned char *)priv->ctrl_setup, priv->ctrl_buf,
+			     0, ch340_ctrl_callback, priv);
+
+	return 0;
+}
+
+static int ch340_port_probe(struct usb_serial_port *port)
+{
+	struct ch340_private *priv;
+	int cpu;
+	int r;
+
+	priv = kzalloc(sizeof(struct ch340_private), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+
+	priv->pcpu_stats = alloc_percpu(struct ch340_pcpu_stats);
+	if (!priv->pcpu_stats) {
+		r = -ENOMEM;
+		goto err_free_priv;
+	}
+	priv->pcpu_hist = alloc_percpu(struct ch340_pcpu_hist);
+	if (!priv->pcpu_hist) {
+		r = -ENOMEM;
+		goto err_free_stats;
+	}
+	for_each_possible_cpu(cpu) {
+		u64_stats_init(&per_cpu_ptr(priv->pcpu_stats, cpu)->syncp);
+		u64_stats_init(&per_cpu_ptr(priv->pcpu_hist, cpu)->syncp);
+	}
+
+	r = ch340_ctrl_alloc(port, priv);
+	if (r)
+		goto err_free_hist;
+
+	priv->chip = usb_get_serial_data(port->serial);
+
+	spin_lock_init(&priv->lock);
+	spin_lock_init(&priv->stats_lock);
+	mutex_init(&priv->int_mutex);
+	mutex_init(&priv->mcr_seq_mutex);
+	mutex_init(&priv->line_mutex);
+	INIT_DELAYED_WORK(&priv->int_work, ch340_int_work);
+	priv->port = port;
+	hrtimer_init(&priv->tx_idle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	priv->tx_idle_timer.function = ch340_tx_idle_timer;
+	INIT_WORK(&priv->rs485_work, ch340_rs485_work);
+	hrtimer_init(&priv->rs485_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	priv->rs485_timer.function = ch340_rs485_timer;
+	priv->int_park = int_park;
+	priv->stats.ctrl_time_min = U64_MAX;
+	priv->stats.int_interval_min = U64_MAX;
+	priv->stats.pm_resume_time_min = U64_MAX;
+	priv->baud_rate = DEFAULT_BAUD_RATE;
+	/*
+	 * Some CH340 devices appear unable to change the initial LCR
+	 * settings, so set a sane 8N1 default.
+	 */
+	priv->lcr = CH340_LCR_ENABLE_RX | CH340_LCR_ENABLE_TX | CH340_LCR_CS8;
+	priv->rx_urb_count = ch340_clamp_rx_urbs(rx_urbs);
+	priv->rx_buf_size = ch340_clamp_rx_buf_size(rx_buf_size);
+	priv->tx_urb_count = ch340_clamp_tx_urbs(tx_urbs);
+	priv->tx_buf_size = ch340_clamp_tx_buf_size(tx_buf_size);
+
+	r = ch340_configure(port->serial->dev, priv);
+	if (r < 0)
+		goto err_free_ctrl;
+
+	r = ch340_detect_quirks(port, priv);
+	if (r < 0)
+		goto err_free_ctrl;
+
+	/* the attributes find priv from the moment they appear */
+	usb_set_serial_port_data(port, priv);
+
+	r = sysfs_create_group(&port->dev.kobj, &ch340_attr_group);
+	if (r)
+		goto err_clear_data;
+
+	ch340_debugfs_init(port, priv);
+
+	if (pps)
+		ch340_pps_register(port, priv);
+
+	if (autosuspend_delay >= 0) {
+		pm_runtime_set_autosuspend_delay(&port->serial->dev->dev,
+						 autosuspend_delay);
+		usb_enable_autosuspend(port->serial->dev);
+	}
+
+	return 0;
+
+err_clear_data:
+	usb_set_serial_port_data(port, NULL);
+err_free_ctrl:
+	ch340_ctrl_free(priv);
+err_free_hist:
+	free_percpu(priv->pcpu_hist);
+err_free_stats:
+	free_percpu(priv->pcpu_stats);
+err_free_priv:
+	kfree(priv);
+	return r;
+}
+
+static int ch340_port_remove(struct usb_serial_port *port)
+{
+	struct ch340_private *priv;
+
+	priv = usb_get_serial_port_data(port);
+	cancel_delayed_work_sync(&priv->int_work);
+	hrtimer_cancel(&priv->tx_idle_timer);
+	hrtimer_cancel(&priv->rs485_timer);
+	cancel_work_sync(&priv->rs485_work);
+	ch340_pps_unregister(priv);
+	debugfs_remove_recursive(priv->debugfs);
+	sysfs_remove_group(&port->dev.kobj, &ch340_attr_group);
+	ch340_rx_free(port);
+	ch340_tx_free(port);
+	ch340_ctrl_free(priv);
+	free_percpu(priv->pcpu_hist);
+	free_percpu(priv->pcpu_stats);
+	kfree(priv);
+
+	return 0;
+}
+
+static int ch340_carrier_raised(struct usb_serial_port *port)
+{
+	if (ch340_get_msr(port) & CH340_BIT_DCD)
+		return 1;
+	return 0;
+}
+
+/*
+ * As usb_serial_generic_msr_changed, but against the per cpu counts,
+ * which port->icount no longer carries.
+ */
+static bool ch340_msr_changed(struct usb_serial_port *port,
+			      unsigned long arg, struct ch340_pcpu_stats *prev)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_pcpu_stats now;
+
+	if (port->serial->disconnected)
+		return true;
+
+	ch340_stats_read_pcpu(priv, &now);
+
+	if ((arg & TIOCM_RNG) && now.rng != prev->rng)
+		return true;
+	if ((arg & TIOCM_DSR) && now.dsr != prev->dsr)
+		return true;
+	if ((arg & TIOCM_CD) && now.dcd != prev->dcd)
+		return true;
+	if ((arg & TIOCM_CTS) && now.cts != prev->cts)
+		return true;
+
+	*prev = now;
+
+	return false;
+}
+
+static int ch340_wait_msr(struct usb_serial_port *port, unsigned long arg)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_pcpu_stats prev;
+	int r;
+
+	ch340_stats_read_pcpu(priv, &prev);
+
+	r = wait_event_interruptible(port->port.delta_msr_wait,
+				     ch340_msr_changed(port, arg, &prev));
+	if (r)
+		return r;
+
+	if (port->serial->disconnected)
+		return -EIO;
+
+	return 0;
+}
+
+static int ch340_tiocmiwait(struct tty_struct *tty, unsigned long arg)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int r;
+
+	mutex_lock(&priv->int_mutex);
+	priv->int_waiters++;
+	r = ch340_int_update(port);
+	mutex_unlock(&priv->int_mutex);
+
+	if (!r)
+		r = ch340_wait_msr(port, arg);
+
+	mutex_lock(&priv->int_mutex);
+	priv->int_waiters--;
+	ch340_int_update(port);
+	mutex_unlock(&priv->int_mutex);
+
+	return r;
 }
 
-static void ch340_close(struct usb_serial_port *port)
-{
-	usb_serial_generic_close(port);
-	usb_kill_urb(port->interrupt_in_urb);
+static int ch340_get_icount(struct tty_struct *tty,
+			    struct serial_icounter_struct *icount)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_pcpu_stats sum;
+
+	ch340_stats_read_pcpu(priv, &sum);
+
+	icount->cts = sum.cts;
+	icount->dsr = sum.dsr;
+	icount->rng = sum.rng;
+	icount->dcd = sum.dcd;
+	icount->rx = sum.rx_bytes;
+	icount->tx = sum.tx_bytes;
+	icount->frame = sum.frame;
+	icount->overrun = sum.overrun;
+	icount->parity = sum.parity;
+	icount->brk = 0;
+	icount->buf_overrun = 0;
+
+	return 0;
+}
+
+static void ch340_dtr_rts(struct usb_serial_port *port, int on)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	u32 rs485;
+
+	spin_lock_irqsave(&port->lock, flags);
+	rs485 = priv->rs485.flags;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	/* drop DTR and RTS; in RS485 mode RTS rests at its idle level */
+	if (!on)
+		ch340_update_mcr(priv, 0, CH340_BIT_RTS | CH340_BIT_DTR);
+	else if (!(rs485 & SER_RS485_ENABLED))
+		ch340_update_mcr(priv, CH340_BIT_RTS | CH340_BIT_DTR, 0);
+	else if (rs485 & SER_RS485_RTS_AFTER_SEND)
+		ch340_update_mcr(priv, CH340_BIT_RTS | CH340_BIT_DTR, 0);
+	else
+		ch340_update_mcr(priv, CH340_BIT_DTR, CH340_BIT_RTS);
+
+	if (ch340_pm_get(port))
+		return;
+	ch340_set_handshake_async(priv);
+	ch340_pm_put(port);
+}
+
+static void ch340_close(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	bool tx_pm;
+
+	spin_lock_irqsave(&port->lock, flags);
+	kfifo_reset_out(&port->write_fifo);
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	mutex_lock(&priv->int_mutex);
+	priv->int_open = false;
+	ch340_int_update(port);
+	mutex_unlock(&priv->int_mutex);
+
+	ch340_rx_kill(port);
+	ch340_tx_kill(port);
+	/* only once no write can complete and arm them again */
+	hrtimer_cancel(&priv->rs485_timer);
+	cancel_work_sync(&priv->rs485_work);
+	hrtimer_cancel(&priv->tx_idle_timer);
+	ch340_rx_free(port);
+	ch340_tx_free(port);
+
+	spin_lock_irqsave(&port->lock, flags);
+	priv->tx_idle = 0;
+	priv->rs485_state = CH340_RS485_IDLE;
+	tx_pm = priv->tx_pm;
+	priv->tx_pm = false;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (tx_pm)
+		usb_autopm_put_interface_async(port->serial->interface);
+
+	/* take back the reference the core drops once the tty goes away */
+	if (priv->pm_idle) {
+		priv->pm_idle = false;
+		port->serial->interface->needs_remote_wakeup = 0;
+		usb_autopm_get_interface_no_resume(port->serial->interface);
+	}
+
+	/* errors seen after the last read must not flag the next session */
+	atomic_set(&priv->lsr, 0);
 }
 
 
@@ -370,28 +3665,60 @@ static int ch340_open(struct tty_struct *tty, struct usb_serial_port *port)
 	if (tty)
 		ch340_set_termios(tty, port, NULL);
 
-	dev_dbg(&port->dev, "%s - submitting interrupt urb\n", __func__);
-	r = usb_submit_urb(port->interrupt_in_urb, GFP_KERNEL);
-	if (r) {
-		dev_err(&port->dev, "%s - failed to submit interrupt urb: %d\n",
-			__func__, r);
+	mutex_lock(&priv->int_mutex);
+	priv->int_open = true;
+	r = ch340_int_update(port);
+	if (r)
+		priv->int_open = false;
+	mutex_unlock(&priv->int_mutex);
+	if (r)
 		return r;
-	}
 
-	r = ch340_get_status(port->serial->dev, priv);
-	if (r < 0) {
-		dev_err(&port->dev, "failed to read modem status: %d\n", r);
-		goto err_kill_interrupt_urb;
+	/* a running interrupt urb was started from a fresh status read */
+	if (!priv->int_running) {
+		r = ch340_get_status(port->serial->dev, priv);
+		if (r < 0) {
+			dev_err(&port->dev, "failed to read modem status: %d\n",
+				r);
+			goto err_kill_interrupt_urb;
+		}
 	}
 
-	r = usb_serial_generic_open(tty, port);
+	r = ch340_tx_alloc(port);
 	if (r)
 		goto err_kill_interrupt_urb;
 
+	r = ch340_rx_alloc(port);
+	if (r)
+		goto err_free_tx;
+
+	clear_bit(CH340_RX_THROTTLED, &priv->flags);
+
+	r = ch340_rx_submit_all(port, GFP_KERNEL);
+	if (r)
+		goto err_free_rx;
+
+	/*
+	 * Let the idle port autosuspend; writes and modem status interest
+	 * keep it awake, and the chip wakes the host for received data.
+	 */
+	if (ch340_pm_idle_allowed(port)) {
+		port->serial->interface->needs_remote_wakeup = 1;
+		priv->pm_idle = true;
+		ch340_pm_put(port);
+	}
+
 	return 0;
 
+err_free_rx:
+	ch340_rx_free(port);
+err_free_tx:
+	ch340_tx_free(port);
 err_kill_interrupt_urb:
-	usb_kill_urb(port->interrupt_in_urb);
+	mutex_lock(&priv->int_mutex);
+	priv->int_open = false;
+	ch340_int_update(port);
+	mutex_unlock(&priv->int_mutex);
 
 	return r;
 }
@@ -399,12 +3726,11 @@ err_kill_interrupt_urb:
 /* Old_termios contains the original termios settings and
  * tty->termios contains the new setting to be used.
  */
-static void ch340_set_termios(struct tty_struct *tty,
+static void __ch340_set_termios(struct tty_struct *tty,
 		struct usb_serial_port *port, struct ktermios *old_termios)
 {
 	struct ch340_private *priv = usb_get_serial_port_data(port);
-	unsigned baud_rate;
-	unsigned long flags;
+	unsigned baud_rate, prev_rate;
 	u8 lcr;
 	int r;
 
@@ -412,6 +3738,9 @@ static void ch340_set_termios(struct tty_struct *tty,
 	if (old_termios && !tty_termios_hw_change(&tty->termios, old_termios))
 		return;
 
+	if (ch340_pm_get(port))
+		return;
+
 	baud_rate = tty_get_baud_rate(tty);
 
 	lcr = CH340_LCR_ENABLE_RX | CH340_LCR_ENABLE_TX;
@@ -443,68 +3772,160 @@ static void ch340_set_termios(struct tty_struct *tty,
 		lcr |= CH340_LCR_STOP_BITS_2;
 
 	if (baud_rate) {
+		prev_rate = priv->baud_rate;
 		priv->baud_rate = baud_rate;
 
-		r = ch340_set_baudrate_lcr(port->serial->dev, priv, lcr);
-		if (r < 0 && old_termios) {
-			priv->baud_rate = tty_termios_baud_rate(old_termios);
-			tty_termios_copy_hw(&tty->termios, old_termios);
-		} else if (r == 0) {
+		r = ch340_baud_check_tolerance(port, priv, baud_rate);
+		if (!r)
+			r = ch340_set_baudrate_lcr(port->serial->dev, priv, lcr);
+		if (r < 0) {
+			/*
+			 * The chip keeps running at the previous rate, or the
+			 * default one on a first open; later restores and
+			 * reconfigures must not skip writing it.
+			 */
+			priv->baud_rate = prev_rate;
+			if (old_termios)
+				tty_termios_copy_hw(&tty->termios, old_termios);
+			else
+				tty_encode_baud_rate(tty, prev_rate, prev_rate);
+		} else {
 			priv->lcr = lcr;
+			/*
+			 * Report the rate really set. A custom (BOTHER) rate
+			 * reads back exactly, a standard one keeps its Bxxx
+			 * code while it is within 2%.
+			 */
+			tty_encode_baud_rate(tty, priv->baud_actual,
+					     priv->baud_actual);
 		}
 	}
 
-	spin_lock_irqsave(&priv->lock, flags);
+	/* RTS belongs to RS485 direction control, as in ch340_set_rs485() */
+	if (C_CRTSCTS(tty) &&
+	    (READ_ONCE(priv->rs485.flags) & SER_RS485_ENABLED))
+		tty->termios.c_cflag &= ~CRTSCTS;
+
+	if (!!C_CRTSCTS(tty) != priv->crtscts) {
+		r = ch340_write_reg(port->serial->dev, priv, CH340_FLOW_REG,
+				    C_CRTSCTS(tty) ? CH340_FLOW_RTSCTS : 0);
+		if (r == 0)
+			priv->crtscts = C_CRTSCTS(tty);
+		else
+			tty->termios.c_cflag ^= CRTSCTS; /* report chip state */
+	}
+
+	mutex_lock(&priv->int_mutex);
+	priv->int_termios = !C_CLOCAL(tty) || C_CRTSCTS(tty);
+	ch340_int_update(port);
+	mutex_unlock(&priv->int_mutex);
+
 	if (C_BAUD(tty) == B0)
-		priv->mcr &= ~(CH340_BIT_DTR | CH340_BIT_RTS);
+		ch340_update_mcr(priv, 0, CH340_BIT_DTR | CH340_BIT_RTS);
 	else if (old_termios && (old_termios->c_cflag & CBAUD) == B0)
-		priv->mcr |= (CH340_BIT_DTR | CH340_BIT_RTS);
-	spin_unlock_irqrestore(&priv->lock, flags);
+		ch340_update_mcr(priv, CH340_BIT_DTR | CH340_BIT_RTS, 0);
 
-	ch340_set_handshake(port->serial->dev, priv->mcr);
+	ch340_set_handshake_async(priv);
+	ch340_pm_put(port);
 }
 
-static void ch340_break_ctl(struct tty_struct *tty, int break_state)
+static void ch340_set_termios(struct tty_struct *tty,
+		struct usb_serial_port *port, struct ktermios *old_termios)
 {
-	const uint16_t ch340_break_reg =
-			((uint16_t) CH340_REG_LCR << 8) | CH340_REG_BREAK;
-	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	mutex_lock(&priv->line_mutex);
+	__ch340_set_termios(tty, port, old_termios);
+	mutex_unlock(&priv->line_mutex);
+}
+
+/*
+ * Read back the break and LCR registers and compare them with what was
+ * just written; the shadow is updated with what the chip really holds.
+ */
+static void ch340_verify_break(struct usb_serial_port *port, u16 expected)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	u8 break_reg[2];
 	int r;
+
+	r = ch340_read_reg(port->serial->dev, priv, CH340_BREAK_REG, break_reg);
+	if (r < 0)
+		return;
+
+	if (get_unaligned_le16(break_reg) != expected) {
+		dev_warn(&port->dev, "%s - break register mismatch: wrote %04x, read %04x\n",
+			 __func__, expected, get_unaligned_le16(break_reg));
+		ch340_invalidate_shadow(priv);
+	}
+}
+
+static void __ch340_break_ctl(struct tty_struct *tty, int break_state)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct usb_device *dev = port->serial->dev;
+	unsigned long flags;
 	uint16_t reg_contents;
-	uint8_t *break_reg;
+	uint8_t break_reg[2];
+	uint8_t nbreak;
+	u8 lcr;
+	int r;
 
-	break_reg = kmalloc(2, GFP_KERNEL);
-	if (!break_reg)
+	if (priv->quirks & CH340_QUIRK_NO_BREAK) {
+		dev_dbg(&port->dev, "%s - not supported\n", __func__);
 		return;
+	}
 
-	r = ch340_control_in(port->serial->dev, CH340_REQ_READ_REG,
-			ch340_break_reg, 0, break_reg, 2);
-	if (r < 0) {
-		dev_err(&port->dev, "%s - USB control read error (%d)\n",
+	/*
+	 * The other bits of the break register are only read once, after
+	 * which each break edge is a single write built from the shadow.
+	 */
+	if (!test_bit(CH340_REG_BREAK, priv->regs_valid)) {
+		r = ch340_read_reg(dev, priv, CH340_BREAK_REG, break_reg);
+		if (r < 0) {
+			dev_err(&port->dev, "%s - USB control read error (%d)\n",
 				__func__, r);
-		goto out;
+			return;
+		}
 	}
-	dev_dbg(&port->dev, "%s - initial ch340 break register contents - reg1: %x, reg2: %x\n",
-		__func__, break_reg[0], break_reg[1]);
+
+	spin_lock_irqsave(&priv->lock, flags);
+	priv->break_on = break_state != 0;
+	lcr = priv->lcr;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	nbreak = priv->regs[CH340_REG_BREAK];
 	if (break_state != 0) {
 		dev_dbg(&port->dev, "%s - Enter break state requested\n", __func__);
-		break_reg[0] &= ~CH340_NBREAK_BITS;
-		break_reg[1] &= ~CH340_LCR_ENABLE_TX;
+		nbreak &= ~CH340_NBREAK_BITS;
+		lcr &= ~CH340_LCR_ENABLE_TX;
 	} else {
 		dev_dbg(&port->dev, "%s - Leave break state requested\n", __func__);
-		break_reg[0] |= CH340_NBREAK_BITS;
-		break_reg[1] |= CH340_LCR_ENABLE_TX;
+		nbreak |= CH340_NBREAK_BITS;
 	}
+
+	reg_contents = ((uint16_t)lcr << 8) | nbreak;
 	dev_dbg(&port->dev, "%s - New ch340 break register contents - reg1: %x, reg2: %x\n",
-		__func__, break_reg[0], break_reg[1]);
-	reg_contents = get_unaligned_le16(break_reg);
-	r = ch340_control_out(port->serial->dev, CH340_REQ_WRITE_REG,
-			ch340_break_reg, reg_contents);
-	if (r < 0)
-		dev_err(&port->dev, "%s - USB control write error (%d)\n",
-				__func__, r);
-out:
-	kfree(break_reg);
+		__func__, nbreak, lcr);
+
+	ch340_write_reg_async(dev, priv, CH340_BREAK_REG, reg_contents);
+
+	if (break_verify)
+		ch340_verify_break(port, reg_contents);
+}
+
+static void ch340_break_ctl(struct tty_struct *tty, int break_state)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	if (ch340_pm_get(port))
+		return;
+	mutex_lock(&priv->line_mutex);
+	__ch340_break_ctl(tty, break_state);
+	mutex_unlock(&priv->line_mutex);
+	ch340_pm_put(port);
 }
 
 static int ch340_tiocmset(struct tty_struct *tty,
@@ -512,42 +3933,80 @@ static int ch340_tiocmset(struct tty_struct *tty,
 {
 	struct usb_serial_port *port = tty->driver_data;
 	struct ch340_private *priv = usb_get_serial_port_data(port);
-	unsigned long flags;
-	u8 control;
+	u8 mcr_set = 0, mcr_clear = 0;
+	int r;
+
+	/* with hardware flow control the chip drives RTS itself */
+	if (priv->crtscts)
+		clear &= ~TIOCM_RTS;
+
+	/* and in RS485 mode the driver does */
+	if (READ_ONCE(priv->rs485.flags) & SER_RS485_ENABLED) {
+		set &= ~TIOCM_RTS;
+		clear &= ~TIOCM_RTS;
+	}
 
-	spin_lock_irqsave(&priv->lock, flags);
 	if (set & TIOCM_RTS)
-		priv->mcr |= CH340_BIT_RTS;
+		mcr_set |= CH340_BIT_RTS;
 	if (set & TIOCM_DTR)
-		priv->mcr |= CH340_BIT_DTR;
+		mcr_set |= CH340_BIT_DTR;
 	if (clear & TIOCM_RTS)
-		priv->mcr &= ~CH340_BIT_RTS;
+		mcr_clear |= CH340_BIT_RTS;
 	if (clear & TIOCM_DTR)
-		priv->mcr &= ~CH340_BIT_DTR;
-	control = priv->mcr;
-	spin_unlock_irqrestore(&priv->lock, flags);
+		mcr_clear |= CH340_BIT_DTR;
+
+	ch340_update_mcr(priv, mcr_set, mcr_clear);
+
+	r = ch340_pm_get(port);
+	if (r)
+		return r;
+	ch340_set_handshake_async(priv);
+	ch340_pm_put(port);
 
-	return ch340_set_handshake(port->serial->dev, control);
+	return 0;
 }
 
 static void ch340_update_status(struct usb_serial_port *port,
 					unsigned char *data, size_t len)
 {
 	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct ch340_pcpu_stats *pcpu;
 	struct tty_struct *tty;
 	unsigned long flags;
 	u8 status;
 	u8 delta;
+	u8 lsr;
 
 	if (len < 4)
 		return;
 
 	status = ~data[2] & CH340_BITS_MODEM_STAT;
+	lsr = ~data[3] & CH340_LSR_ERRORS;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	delta = status ^ priv->msr;
-	priv->msr = status;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	delta = status ^ atomic_xchg(&priv->msr, status);
+	if (lsr)
+		atomic_or(lsr, &priv->lsr);
+
+	if (lsr || delta) {
+		pcpu = ch340_stats_begin(priv, &flags);
+		if (lsr & CH340_LSR_OVERRUN)
+			pcpu->overrun++;
+		if (lsr & CH340_LSR_PARITY)
+			pcpu->parity++;
+		if (lsr & CH340_LSR_FRAME)
+			pcpu->frame++;
+		if (delta & CH340_BIT_CTS)
+			pcpu->cts++;
+		if (delta & CH340_BIT_DSR)
+			pcpu->dsr++;
+		if (delta & CH340_BIT_RI)
+			pcpu->rng++;
+		if (delta & CH340_BIT_DCD)
+			pcpu->dcd++;
+		ch340_stats_end(pcpu, flags);
+	}
+
+	trace_ch340_update_status(&port->dev, data[1], status, delta);
 
 	if (data[1] & CH340_MULT_STAT)
 		dev_dbg(&port->dev, "%s - multiple status change\n", __func__);
@@ -555,14 +4014,8 @@ static void ch340_update_status(struct usb_serial_port *port,
 	if (!delta)
 		return;
 
-	if (delta & CH340_BIT_CTS)
-		port->icount.cts++;
-	if (delta & CH340_BIT_DSR)
-		port->icount.dsr++;
-	if (delta & CH340_BIT_RI)
-		port->icount.rng++;
 	if (delta & CH340_BIT_DCD) {
-		port->icount.dcd++;
+		ch340_pps_event(priv, status & CH340_BIT_DCD);
 		tty = tty_port_tty_get(&port->port);
 		if (tty) {
 			usb_serial_handle_dcd_change(port, tty,
@@ -577,10 +4030,27 @@ static void ch340_update_status(struct usb_serial_port *port,
 static void ch340_read_int_callback(struct urb *urb)
 {
 	struct usb_serial_port *port = urb->context;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
 	unsigned char *data = urb->transfer_buffer;
 	unsigned int len = urb->actual_length;
+	ktime_t now;
+	s64 interval = 0;
 	int status;
 
+	/* stamp first, so nothing below adds to the edge latency */
+	ch340_pps_stamp(priv);
+	now = ktime_get();
+
+	if (priv->int_completed)
+		interval = ktime_to_ns(ktime_sub(now, priv->int_completed));
+	priv->int_completed = now;
+
+	ch340_stats_urb(priv, CH340_PIPE_INT, urb->status, len);
+	if (!urb->status && interval)
+		ch340_stats_int_interval(priv, interval);
+
+	trace_ch340_read_int(&port->dev, len, urb->status, interval);
+
 	switch (urb->status) {
 	case 0:
 		/* success */
@@ -593,18 +4063,27 @@ static void ch340_read_int_callback(struct urb *urb)
 			__func__, urb->status);
 		return;
 	default:
-		dev_dbg(&urb->dev->dev, "%s - nonzero urb status: %d\n",
-			__func__, urb->status);
-		goto exit;
+		dev_dbg_ratelimited(&urb->dev->dev,
+				    "%s - nonzero urb status: %d\n",
+				    __func__, urb->status);
+		ch340_int_backoff(port, urb->status);
+		return;
 	}
 
+	priv->int_errors = 0;
+
 	usb_serial_debug_data(&port->dev, __func__, len, data);
 	ch340_update_status(port, data, len);
-exit:
+
 	status = usb_submit_urb(urb, GFP_ATOMIC);
 	if (status) {
-		dev_err(&urb->dev->dev, "%s - usb_submit_urb failed: %d\n",
-			__func__, status);
+		ch340_stats_inc(priv, &priv->stats.int_resubmit_failed);
+		if (status == -EPERM || status == -ENODEV)
+			return;
+		dev_err_ratelimited(&urb->dev->dev,
+				    "%s - usb_submit_urb failed: %d\n",
+				    __func__, status);
+		ch340_int_backoff(port, status);
 	}
 }
 
@@ -612,15 +4091,12 @@ static int ch340_tiocmget(struct tty_struct *tty)
 {
 	struct usb_serial_port *port = tty->driver_data;
 	struct ch340_private *priv = usb_get_serial_port_data(port);
-	unsigned long flags;
 	u8 mcr;
 	u8 status;
 	unsigned int result;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	mcr = priv->mcr;
-	status = priv->msr;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	mcr = atomic_read(&priv->mcr);
+	status = ch340_get_msr(port);
 
 	result = ((mcr & CH340_BIT_DTR)		? TIOCM_DTR : 0)
 		  | ((mcr & CH340_BIT_RTS)	? TIOCM_RTS : 0)
@@ -634,41 +4110,339 @@ static int ch340_tiocmget(struct tty_struct *tty)
 	return result;
 }
 
+static int ch340_get_serial(struct tty_struct *tty, struct serial_struct *ss)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+
+	ss->line = port->minor;
+	ss->port = port->port_number;
+	ss->baud_base = priv->chip->max_baud;
+	ss->xmit_fifo_size = priv->chip->fifo_size;
+	if (priv->rx_mode == CH340_RX_MODE_LATENCY)
+		ss->flags |= ASYNC_LOW_LATENCY;
+
+	return 0;
+}
+
+/*
+ * ASYNC_LOW_LATENCY selects latency mode, clearing it returns to auto
+ * mode unless throughput mode was chosen through sysfs.
+ */
+static int ch340_set_serial(struct tty_struct *tty, struct serial_struct *ss)
+{
+	struct usb_serial_port *port = tty->driver_data;
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	enum ch340_rx_mode mode = priv->rx_mode;
+
+	if (ss->flags & ASYNC_LOW_LATENCY)
+		mode = CH340_RX_MODE_LATENCY;
+	else if (mode == CH340_RX_MODE_LATENCY)
+		mode = CH340_RX_MODE_AUTO;
+
+	return ch340_set_rx_mode(port, mode);
+}
+
+static int ch340_get_rs485(struct usb_serial_port *port,
+			   struct serial_rs485 __user *arg)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct serial_rs485 rs485;
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->lock, flags);
+	rs485 = priv->rs485;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if (copy_to_user(arg, &rs485, sizeof(rs485)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Apply new RS485 settings, sanitised the way the serial core does, and
+ * report back the ones in effect.
+ */
+static int ch340_set_rs485(struct usb_serial_port *port,
+			   struct serial_rs485 __user *arg)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	struct serial_rs485 rs485;
+	unsigned long flags;
+	int r = 0;
+
+	if (copy_from_user(&rs485, arg, sizeof(rs485)))
+		return -EFAULT;
+
+	rs485.flags &= SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND |
+		       SER_RS485_RTS_AFTER_SEND;
+	if (!(rs485.flags & SER_RS485_RTS_ON_SEND) ==
+	    !(rs485.flags & SER_RS485_RTS_AFTER_SEND)) {
+		rs485.flags |= SER_RS485_RTS_ON_SEND;
+		rs485.flags &= ~SER_RS485_RTS_AFTER_SEND;
+	}
+	rs485.delay_rts_before_send = min_t(u32, rs485.delay_rts_before_send,
+					    CH340_RS485_DELAY_MAX_MS);
+	rs485.delay_rts_after_send = min_t(u32, rs485.delay_rts_after_send,
+					   CH340_RS485_DELAY_MAX_MS);
+	memset(rs485.padding, 0, sizeof(rs485.padding));
+
+	mutex_lock(&priv->line_mutex);
+
+	/* RTS cannot be both a flow control input and the direction */
+	if ((rs485.flags & SER_RS485_ENABLED) && priv->crtscts) {
+		mutex_unlock(&priv->line_mutex);
+		return -EINVAL;
+	}
+
+	hrtimer_cancel(&priv->rs485_timer);
+	cancel_work_sync(&priv->rs485_work);
+
+	spin_lock_irqsave(&port->lock, flags);
+	priv->rs485 = rs485;
+	priv->rs485_state = CH340_RS485_IDLE;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	if ((rs485.flags & SER_RS485_ENABLED) &&
+	    tty_port_initialized(&port->port)) {
+		r = ch340_pm_get(port);
+		if (!r) {
+			r = ch340_rs485_set_rts(priv,
+					rs485.flags & SER_RS485_RTS_AFTER_SEND);
+			ch340_pm_put(port);
+		}
+		ch340_write_start(port, GFP_KERNEL);
+	}
+	mutex_unlock(&priv->line_mutex);
+
+	if (copy_to_user(arg, &rs485, sizeof(rs485)))
+		return -EFAULT;
+
+	return r < 0 ? r : 0;
+}
+
+static int ch340_ioctl(struct tty_struct *tty, unsigned int cmd,
+		       unsigned long arg)
+{
+	struct usb_serial_port *port = tty->driver_data;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+	struct serial_struct ss;
+	int r;
+#endif
+
+	switch (cmd) {
+	case TIOCGRS485:
+		return ch340_get_rs485(port, (void __user *)arg);
+	case TIOCSRS485:
+		return ch340_set_rs485(port, (void __user *)arg);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+	case TIOCGSERIAL:
+		memset(&ss, 0, sizeof(ss));
+		r = ch340_get_serial(tty, &ss);
+		if (r)
+			return r;
+		if (copy_to_user((void __user *)arg, &ss, sizeof(ss)))
+			return -EFAULT;
+		return 0;
+	case TIOCSSERIAL:
+		if (copy_from_user(&ss, (void __user *)arg, sizeof(ss)))
+			return -EFAULT;
+		return ch340_set_serial(tty, &ss);
+#endif
+	}
+
+	return -ENOIOCTLCMD;
+}
+
+static int ch340_suspend(struct usb_serial *serial, pm_message_t message)
+{
+	struct usb_serial_port *port = serial->port[0];
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&port->lock, flags);
+	/* queued output must go out before the port autosuspends */
+	if (PMSG_IS_AUTO(message) &&
+	    (port->tx_bytes || kfifo_len(&port->write_fifo))) {
+		spin_unlock_irqrestore(&port->lock, flags);
+		return -EBUSY;
+	}
+	priv->suspended = true;
+	spin_unlock_irqrestore(&port->lock, flags);
+
+	cancel_delayed_work_sync(&priv->int_work);
+	ch340_ctrl_flush(priv);
+	ch340_rx_kill(port);
+
+	/*
+	 * The core only poisons port->write_urbs. Stop this driver's write
+	 * ring the same way, so that a write_start() that got past the
+	 * suspended check cannot submit to a suspended device; what is
+	 * still in the fifo goes out from ch340_resume_io().
+	 */
+	for (i = 0; i < priv->tx_urbs_active; ++i)
+		usb_poison_urb(priv->tx_urbs[i]);
+
+	ch340_stats_inc(priv, &priv->stats.pm_suspends);
+
+	return 0;
+}
+
+static void ch340_clear_suspended(struct usb_serial_port *port)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < priv->tx_urbs_active; ++i)
+		usb_unpoison_urb(priv->tx_urbs[i]);
+
+	spin_lock_irqsave(&port->lock, flags);
+	priv->suspended = false;
+	spin_unlock_irqrestore(&port->lock, flags);
+}
+
+static int ch340_resume_int(struct usb_serial_port *port, gfp_t mem_flags)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int r;
+
+	if (!priv->int_running)
+		return 0;
+
+	ch340_int_reset_errors(priv);
+	priv->int_completed = 0;
+	r = usb_submit_urb(port->interrupt_in_urb, mem_flags);
+	if (r) {
+		dev_err(&port->dev, "failed to submit interrupt urb: %d\n", r);
+		return r;
+	}
+
+	return 0;
+}
+
+static int ch340_resume_io(struct usb_serial_port *port, gfp_t mem_flags)
+{
+	struct ch340_private *priv = usb_get_serial_port_data(port);
+	int r;
+
+	ch340_clear_suspended(port);
+
+	if (!test_bit(CH340_RX_THROTTLED, &priv->flags)) {
+		r = ch340_rx_submit_all(port, mem_flags);
+		if (r)
+			return r;
+	}
+
+	return ch340_write_start(port, mem_flags);
+}
+
+/*
+ * The generic resume would submit the generic read urbs, which this
+ * driver does not use, so restart the read ring and the write path here.
+ */
+static int ch340_resume_port(struct usb_serial_port *port, gfp_t mem_flags)
+{
+	int r;
+
+	if (!tty_port_initialized(&port->port)) {
+		ch340_clear_suspended(port);
+		return 0;
+	}
+
+	r = ch340_resume_int(port, mem_flags);
+	if (r)
+		return r;
+
+	return ch340_resume_io(port, mem_flags);
+}
+
+static int ch340_resume(struct usb_serial *serial)
+{
+	struct usb_serial_port *port = serial->port[0];
+	ktime_t start = ktime_get();
+	int r;
+
+	r = ch340_resume_port(port, GFP_NOIO);
+	ch340_stats_pm_resume(usb_get_serial_port_data(port), start);
+
+	return r;
+}
+
 static int ch340_reset_resume(struct usb_serial *serial)
 {
 	struct usb_serial_port *port = serial->port[0];
 	struct ch340_private *priv = usb_get_serial_port_data(port);
+	bool open = tty_port_initialized(&port->port);
+	struct ch340_ctrl_batch batch;
+	ktime_t start = ktime_get();
+	unsigned int actual = 0;
+	u8 status[2];
 	int ret;
 
-	/* reconfigure ch340 serial port after bus-reset */
-	ch340_configure(serial->dev, priv);
+	/*
+	 * Restore the chip after a bus reset from the cached settings; the
+	 * version and quirks are already known. The writes and the modem
+	 * status read go out back to back, and the interrupt urb, which only
+	 * reports status, is resubmitted while they are in flight.
+	 */
+	ch340_batch_init(&batch);
+	ch340_batch_restore(serial->dev, priv, &batch, &actual);
+	if (open) {
+		ch340_batch_control(priv, &batch, CH340_REQ_READ_REG, 0x0706, 0,
+				    status, sizeof(status));
+		ch340_resume_int(port, GFP_NOIO);
+	}
 
-	if (tty_port_initialized(&port->port)) {
-		ret = usb_submit_urb(port->interrupt_in_urb, GFP_NOIO);
-		if (ret) {
-			dev_err(&port->dev, "failed to submit interrupt urb: %d\n",
-				ret);
-			return ret;
-		}
+	ret = ch340_batch_wait(priv, &batch);
+	if (ret < 0) {
+		dev_err(&port->dev, "failed to restore settings: %d\n", ret);
+	} else {
+		priv->baud_actual = actual;
+		WRITE_ONCE(priv->tx_char_ns, ch340_char_ns(actual, priv->lcr));
+		if (open)
+			atomic_set(&priv->msr,
+				   ~status[0] & CH340_BITS_MODEM_STAT);
+	}
 
-		ret = ch340_get_status(port->serial->dev, priv);
-		if (ret < 0) {
-			dev_err(&port->dev, "failed to read modem status: %d\n",
-				ret);
-		}
+	/* data must not go out before the line settings are back */
+	if (open) {
+		ret = ch340_resume_io(port, GFP_NOIO);
+	} else {
+		ch340_clear_suspended(port);
+		ret = 0;
 	}
+	ch340_stats_pm_resume(priv, start);
+
+	return ret;
+}
+
+/* Keep the matched chip for the ports to pick up, as ftdi_sio does. */
+static int ch340_probe(struct usb_serial *serial,
+		       const struct usb_device_id *id)
+{
+	usb_set_serial_data(serial, (void *)id->driver_info);
 
-	return usb_serial_generic_resume(serial);
+	return 0;
 }
 
 static struct usb_serial_driver ch340_device = {
 	.driver = {
 		.owner	= THIS_MODULE,
 		.name	= "ch340-uart",
+		/* lets many adapters configure in parallel at boot */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.id_table          = id_table,
 	.num_ports         = 1,
+	.probe             = ch340_probe,
 	.open              = ch340_open,
+	.write             = ch340_write,
+	.write_bulk_callback = ch340_write_bulk_callback,
+	.chars_in_buffer   = ch340_chars_in_buffer,
+	.tx_empty          = ch340_tx_empty,
 	.dtr_rts	   = ch340_dtr_rts,
 	.carrier_raised	   = ch340_carrier_raised,
 	.close             = ch340_close,
@@ -676,10 +4450,22 @@ static struct usb_serial_driver ch340_device = {
 	.break_ctl         = ch340_break_ctl,
 	.tiocmget          = ch340_tiocmget,
 	.tiocmset          = ch340_tiocmset,
-	.tiocmiwait        = usb_serial_generic_tiocmiwait,
+	.tiocmiwait        = ch340_tiocmiwait,
+	.get_icount        = ch340_get_icount,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	.get_serial        = ch340_get_serial,
+	.set_serial        = ch340_set_serial,
+#endif
+	.ioctl             = ch340_ioctl,
+	.throttle          = ch340_throttle,
+	.unthrottle        = ch340_unthrottle,
 	.read_int_callback = ch340_read_int_callback,
+	.process_read_urb  = ch340_process_read_urb,
+	.prepare_write_buffer = ch340_prepare_write_buffer,
 	.port_probe        = ch340_port_probe,
 	.port_remove       = ch340_port_remove,
+	.suspend           = ch340_suspend,
+	.resume            = ch340_resume,
 	.reset_resume      = ch340_reset_resume,
 };
 
@@ -687,6 +4473,28 @@ static struct usb_serial_driver * const serial_drivers[] = {
 	&ch340_device, NULL
 };
 
-module_usb_serial_driver(serial_drivers, id_table);
+static int __init ch340_init(void)
+{
+	int r;
+
+	ch340_debugfs_root = debugfs_create_dir(KBUILD_MODNAME,
+						usb_debug_root);
+
+	r = usb_serial_register_drivers(serial_drivers, KBUILD_MODNAME,
+					id_table);
+	if (r)
+		debugfs_remove_recursive(ch340_debugfs_root);
+
+	return r;
+}
+
+static void __exit ch340_exit(void)
+{
+	usb_serial_deregister_drivers(serial_drivers);
+	debugfs_remove_recursive(ch340_debugfs_root);
+}
+
+module_init(ch340_init);
+module_exit(ch340_exit);
 
 MODULE_LICENSE("GPL v2");
@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Baud rate divisor calculation for the CH340, kept apart from the driver
+ * so that ch340_kunit.c can test it without a device.
+ */
+#ifndef _CH340_BAUD_H
+#define _CH340_BAUD_H
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+/*******************************/
+/* baudrate calculation factor */
+/*******************************/
+// #define CH340_BAUDBASE_FACTOR 1532620800
+#define CH340_BAUDBASE_FACTOR 6000000
+#define CH340_BAUDBASE_DIVMAX 3
+
+/* highest rate in the table, and of any chip the driver matches */
+#define CH340_BAUD_MAX 3000000
+
+/*
+ * Divisor settings for the standard and common high-speed rates, chosen by
+ * an exhaustive search over all factor, divisor and x2 combinations for the
+ * one closest to the requested rate. The search in ch340_calc_baud() is
+ * only used for rates not listed here.
+ */
+struct ch340_baud_entry {
+	unsigned int rate;
+	u8 factor;
+	u8 divisor;
+	bool x2;
+};
+
+static const struct ch340_baud_entry ch340_baud_table[] = {
+	{      50, 234, 0, 0 },
+	{      75, 156, 0, 0 },
+	{     110, 213, 0, 1 },
+	{     134, 175, 0, 1 },
+	{     150,  78, 0, 0 },
+	{     200, 117, 0, 1 },
+	{     300,  39, 0, 0 },
+	{     600, 156, 1, 0 },
+	{    1200,  78, 1, 0 },
+	{    1800,  52, 1, 0 },
+	{    2400,  39, 1, 0 },
+	{    4800, 156, 2, 0 },
+	{    9600,  78, 2, 0 },
+	{   19200,  39, 2, 0 },
+	{   38400, 156, 3, 0 },
+	{   57600, 104, 3, 0 },
+	{  115200,  52, 3, 0 },
+	{  230400,  26, 3, 0 },
+	{  250000,  24, 3, 0 },
+	{  460800,  13, 3, 0 },
+	{  500000,  12, 3, 0 },
+	{  576000,  21, 3, 1 },
+	{  921600,  13, 3, 1 },
+	{ 1000000,   6, 3, 0 },
+	{ 1500000,   4, 3, 0 },
+	{ 2000000,   3, 3, 0 },
+	{ 3000000,   2, 3, 0 },
+};
+
+static const struct ch340_baud_entry *ch340_baud_lookup(unsigned int rate)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ch340_baud_table); i++) {
+		if (ch340_baud_table[i].rate == rate)
+			return &ch340_baud_table[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the factor, prescaler divisor and clock doubling that come closest
+ * to rate, from the table or by search. This depends on nothing but its
+ * arguments, so it can be checked and timed apart from the USB writes.
+ * Returns the rate the setting really gives, or 0 if no setting fits.
+ */
+static unsigned int ch340_calc_baud(unsigned int rate, bool limited_prescaler,
+				    struct ch340_baud_entry *set)
+{
+	const struct ch340_baud_entry *entry;
+	unsigned int factor, diff, res;
+	short divisor, div;
+	unsigned int best_factor, best_divisor, best_diff;
+	bool x2 = 0;
+
+	if (!rate)
+		return 0;
+
+	entry = ch340_baud_lookup(rate);
+	if (entry && entry->x2 && entry->divisor < CH340_BAUDBASE_DIVMAX &&
+	    limited_prescaler)
+		entry = NULL;
+	if (entry) {
+		best_factor = entry->factor;
+		best_divisor = entry->divisor;
+		x2 = entry->x2;
+		goto found;
+	}
+
+	/* Calcule without x2 multiplier */
+	factor = DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR, rate);
+	divisor = CH340_BAUDBASE_DIVMAX;
+	div = 1;
+
+	while ((factor > 0xff) && divisor) {
+		factor >>= 3;
+		divisor--;
+		div <<= 3;
+	}
+
+	res = DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR, factor * div);
+	diff = (res > rate) ? (res - rate) : (rate - res);
+
+	best_factor = factor;
+	best_divisor = divisor;
+	best_diff = diff;
+
+	/* Check x2 multiplier, which needs the highest prescaler on some chips */
+	factor = DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR * 2, rate);
+	divisor = CH340_BAUDBASE_DIVMAX;
+	div = 1;
+
+	while ((factor > 0xff) && divisor) {
+		factor >>= 3;
+		divisor--;
+		div <<= 3;
+	}
+
+	if (factor > 8 && factor <= 0xff &&
+	    !(divisor < CH340_BAUDBASE_DIVMAX && limited_prescaler)) {
+		res = DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR * 2, factor * div);
+		diff = (res > rate) ? (res - rate) : (rate - res);
+
+		if (diff < best_diff) {
+			best_factor = factor;
+			best_divisor = divisor;
+			x2 = 1;
+		}
+	}
+
+found:
+	if (best_factor <= 1 || best_factor > 0xff)
+		return 0;
+
+	set->rate = rate;
+	set->factor = best_factor;
+	set->divisor = best_divisor;
+	set->x2 = x2;
+
+	div = 1 << (3 * (CH340_BAUDBASE_DIVMAX - best_divisor));
+	return DIV_ROUND_CLOSEST(CH340_BAUDBASE_FACTOR << x2, best_factor * div);
+}
+
+#endif /* _CH340_BAUD_H */
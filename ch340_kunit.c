@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests for the CH340 baud rate divisor calculation. Built as its
+ * own module on kernels with CONFIG_KUNIT; run with "make kunit".
+ */
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+#include "ch340_baud.h"
+
+#define CH340_KUNIT_BAUD_MIN 50
+
+/* The prescaler divides the base clock by 8 for each step below DIVMAX. */
+static u64 ch340_kunit_div(const struct ch340_baud_entry *set)
+{
+	return (u64)set->factor << (3 * (CH340_BAUDBASE_DIVMAX - set->divisor));
+}
+
+/*
+ * Check one result against the register model: the setting must be one
+ * the chip accepts, the returned rate must be what the setting gives,
+ * and the exact rate must be less than one step of the factor away from
+ * the request, |FACTOR << x2 / div - rate| < rate / factor.
+ */
+static void ch340_kunit_check(struct kunit *test, unsigned int rate,
+			      bool limited_prescaler)
+{
+	struct ch340_baud_entry set;
+	unsigned int actual;
+	u64 clock, div;
+	u64 err;
+
+	actual = ch340_calc_baud(rate, limited_prescaler, &set);
+	KUNIT_ASSERT_NE_MSG(test, actual, 0U, "no setting for %u baud", rate);
+
+	KUNIT_ASSERT_GE_MSG(test, set.factor, 2, "%u baud", rate);
+	KUNIT_ASSERT_LE_MSG(test, set.divisor, CH340_BAUDBASE_DIVMAX,
+			    "%u baud", rate);
+	if (set.x2) {
+		KUNIT_ASSERT_GT_MSG(test, set.factor, 8, "%u baud", rate);
+		if (limited_prescaler)
+			KUNIT_ASSERT_EQ_MSG(test, set.divisor,
+					    CH340_BAUDBASE_DIVMAX,
+					    "%u baud", rate);
+	}
+
+	clock = (u64)CH340_BAUDBASE_FACTOR << set.x2;
+	div = ch340_kunit_div(&set);
+	KUNIT_ASSERT_EQ_MSG(test, (u64)actual,
+			    div64_u64(clock + div / 2, div), "%u baud", rate);
+
+	err = abs((s64)clock - (s64)(rate * div));
+	KUNIT_ASSERT_LT_MSG(test, err * set.factor, rate * div,
+			    "%u baud gives %u baud", rate, actual);
+}
+
+static void ch340_kunit_sweep(struct kunit *test, bool limited_prescaler)
+{
+	unsigned int rate;
+
+	for (rate = CH340_KUNIT_BAUD_MIN; rate <= CH340_BAUD_MAX; rate++) {
+		ch340_kunit_check(test, rate, limited_prescaler);
+		if (!(rate % 65536))
+			cond_resched();
+	}
+}
+
+static void ch340_kunit_sweep_full(struct kunit *test)
+{
+	ch340_kunit_sweep(test, false);
+}
+
+static void ch340_kunit_sweep_limited_prescaler(struct kunit *test)
+{
+	ch340_kunit_sweep(test, true);
+}
+
+/* Table rates come back with the setting the table gives for them. */
+static void ch340_kunit_table(struct kunit *test)
+{
+	const struct ch340_baud_entry *entry;
+	struct ch340_baud_entry set;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ch340_baud_table); i++) {
+		entry = &ch340_baud_table[i];
+		KUNIT_ASSERT_NE(test, ch340_calc_baud(entry->rate, false, &set),
+				0U);
+		KUNIT_EXPECT_EQ_MSG(test, set.factor, entry->factor,
+				    "%u baud", entry->rate);
+		KUNIT_EXPECT_EQ_MSG(test, set.divisor, entry->divisor,
+				    "%u baud", entry->rate);
+		KUNIT_EXPECT_EQ_MSG(test, set.x2, entry->x2,
+				    "%u baud", entry->rate);
+	}
+}
+
+static void ch340_kunit_out_of_range(struct kunit *test)
+{
+	struct ch340_baud_entry set;
+
+	KUNIT_EXPECT_EQ(test, ch340_calc_baud(0, false, &set), 0U);
+	KUNIT_EXPECT_EQ(test, ch340_calc_baud(0, true, &set), 0U);
+}
+
+/* Report the average cost of a call over the whole range. */
+static void ch340_kunit_timing(struct kunit *test)
+{
+	struct ch340_baud_entry set;
+	unsigned int calls = 0;
+	unsigned int rate;
+	u64 sum = 0;
+	ktime_t start;
+	u64 ns;
+	int lp;
+
+	start = ktime_get();
+	for (lp = 0; lp < 2; lp++) {
+		for (rate = CH340_KUNIT_BAUD_MIN; rate <= CH340_BAUD_MAX;
+		     rate++, calls++)
+			sum += ch340_calc_baud(rate, lp, &set);
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	/* keep the calls from being optimised out */
+	KUNIT_EXPECT_NE(test, sum, 0ULL);
+	kunit_info(test, "%u calls in %llu ns, %llu ns per call\n", calls, ns,
+		   div_u64(ns, calls));
+}
+
+static struct kunit_case ch340_baud_cases[] = {
+	KUNIT_CASE(ch340_kunit_sweep_full),
+	KUNIT_CASE(ch340_kunit_sweep_limited_prescaler),
+	KUNIT_CASE(ch340_kunit_table),
+	KUNIT_CASE(ch340_kunit_out_of_range),
+	KUNIT_CASE(ch340_kunit_timing),
+	{}
+};
+
+static struct kunit_suite ch340_baud_suite = {
+	.name = "ch340_baud",
+	.test_cases = ch340_baud_cases,
+};
+kunit_test_suite(ch340_baud_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the CH340 baud rate calculation");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the CH340 driver, for profiling the control, status and
+ * bulk paths without the cost of dev_dbg.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ch340
+
+#if !defined(_CH340_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CH340_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+/* a control request completing, duration measured from its submission */
+TRACE_EVENT(ch340_control,
+	TP_PROTO(struct device *dev, u8 request, u16 value, u16 index,
+		 u16 size, int status, s64 duration),
+	TP_ARGS(dev, request, value, index, size, status, duration),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u8, request)
+		__field(u16, value)
+		__field(u16, index)
+		__field(u16, size)
+		__field(int, status)
+		__field(s64, duration)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->request = request;
+		__entry->value = value;
+		__entry->index = index;
+		__entry->size = size;
+		__entry->status = status;
+		__entry->duration = duration;
+	),
+	TP_printk("%s request=%02x value=%04x index=%04x len=%u status=%d duration=%lldns",
+		  __get_str(dev), __entry->request, __entry->value,
+		  __entry->index, __entry->size, __entry->status,
+		  __entry->duration)
+);
+
+/* a bulk urb completing, duration measured from its submission */
+DECLARE_EVENT_CLASS(ch340_bulk,
+	TP_PROTO(struct device *dev, int urb, unsigned int len, int status,
+		 s64 duration),
+	TP_ARGS(dev, urb, len, status, duration),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(int, urb)
+		__field(unsigned int, len)
+		__field(int, status)
+		__field(s64, duration)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->urb = urb;
+		__entry->len = len;
+		__entry->status = status;
+		__entry->duration = duration;
+	),
+	TP_printk("%s urb=%d len=%u status=%d duration=%lldns",
+		  __get_str(dev), __entry->urb, __entry->len,
+		  __entry->status, __entry->duration)
+);
+
+DEFINE_EVENT(ch340_bulk, ch340_read_bulk,
+	TP_PROTO(struct device *dev, int urb, unsigned int len, int status,
+		 s64 duration),
+	TP_ARGS(dev, urb, len, status, duration)
+);
+
+DEFINE_EVENT(ch340_bulk, ch340_write_bulk,
+	TP_PROTO(struct device *dev, int urb, unsigned int len, int status,
+		 s64 duration),
+	TP_ARGS(dev, urb, len, status, duration)
+);
+
+/* an interrupt urb completing, interval since the previous completion */
+TRACE_EVENT(ch340_read_int,
+	TP_PROTO(struct device *dev, unsigned int len, int status,
+		 s64 interval),
+	TP_ARGS(dev, len, status, interval),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(unsigned int, len)
+		__field(int, status)
+		__field(s64, interval)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->len = len;
+		__entry->status = status;
+		__entry->interval = interval;
+	),
+	TP_printk("%s len=%u status=%d interval=%lldns", __get_str(dev),
+		  __entry->len, __entry->status, __entry->interval)
+);
+
+TRACE_EVENT(ch340_update_status,
+	TP_PROTO(struct device *dev, u8 flags, u8 msr, u8 delta),
+	TP_ARGS(dev, flags, msr, delta),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u8, flags)
+		__field(u8, msr)
+		__field(u8, delta)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->flags = flags;
+		__entry->msr = msr;
+		__entry->delta = delta;
+	),
+	TP_printk("%s flags=%02x msr=%02x delta=%02x", __get_str(dev),
+		  __entry->flags, __entry->msr, __entry->delta)
+);
+
+/* both register writes of a line setting change, including their waits */
+TRACE_EVENT(ch340_set_baudrate_lcr,
+	TP_PROTO(struct device *dev, unsigned int baud, unsigned int actual,
+		 u16 divisor, u8 lcr, int status, s64 duration),
+	TP_ARGS(dev, baud, actual, divisor, lcr, status, duration),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(unsigned int, baud)
+		__field(unsigned int, actual)
+		__field(u16, divisor)
+		__field(u8, lcr)
+		__field(int, status)
+		__field(s64, duration)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->baud = baud;
+		__entry->actual = actual;
+		__entry->divisor = divisor;
+		__entry->lcr = lcr;
+		__entry->status = status;
+		__entry->duration = duration;
+	),
+	TP_printk("%s baud=%u actual=%u divisor=%04x lcr=%02x status=%d duration=%lldns",
+		  __get_str(dev), __entry->baud, __entry->actual,
+		  __entry->divisor, __entry->lcr, __entry->status,
+		  __entry->duration)
+);
+
+#endif /* _CH340_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ch340_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,595 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ch340-bench measures the CH340 driver from userspace, on adapters whose
+ * TX is wired to their own RX (loopback) or to the RX of a second adapter.
+ *
+ * Each port argument is "tx[:rx]"; without an rx device the tx device is
+ * expected to be in loopback. Results are printed as one JSON object per
+ * line so that runs against different driver versions can be compared.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+#define BENCH_MAX_PORTS 16
+#define BENCH_MAX_FRAME 4096
+
+struct bench_port {
+	const char *tx_name;
+	const char *rx_name;
+	int tx;
+	int rx;
+};
+
+struct bench_opts {
+	unsigned int bauds[32];
+	unsigned int nbauds;
+	unsigned int seconds;
+	unsigned int iterations;
+	unsigned int frame;
+	unsigned int timeout_ms;
+};
+
+static const struct {
+	unsigned int rate;
+	speed_t speed;
+} bench_speeds[] = {
+	{ 50, B50 }, { 75, B75 }, { 110, B110 }, { 134, B134 },
+	{ 150, B150 }, { 200, B200 }, { 300, B300 }, { 600, B600 },
+	{ 1200, B1200 }, { 1800, B1800 }, { 2400, B2400 },
+	{ 4800, B4800 }, { 9600, B9600 }, { 19200, B19200 },
+	{ 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+	{ 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 },
+	{ 576000, B576000 }, { 921600, B921600 }, { 1000000, B1000000 },
+	{ 1152000, B1152000 }, { 1500000, B1500000 },
+	{ 2000000, B2000000 },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Print the percentiles of n samples, in ns, as JSON members. */
+static void print_percentiles(uint64_t *samples, unsigned int n)
+{
+	uint64_t total = 0;
+	unsigned int i;
+
+	if (!n) {
+		printf("\"samples\":0");
+		return;
+	}
+
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	for (i = 0; i < n; i++)
+		total += samples[i];
+
+	printf("\"samples\":%u,\"min_ns\":%llu,\"avg_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu",
+	       n, (unsigned long long)samples[0],
+	       (unsigned long long)(total / n),
+	       (unsigned long long)samples[n / 2],
+	       (unsigned long long)samples[n * 90 / 100],
+	       (unsigned long long)samples[n * 99 / 100],
+	       (unsigned long long)samples[n - 1]);
+}
+
+static int set_raw(int fd, unsigned int baud)
+{
+	struct termios tio;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(bench_speeds) / sizeof(bench_speeds[0]); i++) {
+		if (bench_speeds[i].rate == baud)
+			break;
+	}
+	if (i == sizeof(bench_speeds) / sizeof(bench_speeds[0])) {
+		fprintf(stderr, "unsupported baud rate %u\n", baud);
+		return -1;
+	}
+
+	if (tcgetattr(fd, &tio))
+		return -1;
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~CRTSCTS;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetspeed(&tio, bench_speeds[i].speed);
+
+	if (tcsetattr(fd, TCSANOW, &tio))
+		return -1;
+
+	return tcflush(fd, TCIOFLUSH);
+}
+
+static int set_baud(struct bench_port *p, unsigned int baud)
+{
+	if (set_raw(p->tx, baud))
+		return -1;
+	if (p->rx != p->tx && set_raw(p->rx, baud))
+		return -1;
+
+	return 0;
+}
+
+/* Read exactly len bytes, or fail after timeout_ms without progress. */
+static int read_full(int fd, unsigned char *buf, size_t len,
+		     unsigned int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	size_t got = 0;
+	ssize_t r;
+
+	while (got < len) {
+		r = poll(&pfd, 1, timeout_ms);
+		if (r <= 0)
+			return -1;
+
+		r = read(fd, buf + got, len - got);
+		if (r < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (r > 0)
+			got += r;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+struct stream_ctx {
+	struct bench_port *port;
+	unsigned int seconds;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t elapsed;
+	bool stop;
+};
+
+static void *stream_writer(void *arg)
+{
+	struct stream_ctx *ctx = arg;
+	unsigned char buf[512];
+	unsigned int i;
+	ssize_t r;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i;
+
+	while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+		r = write(ctx->port->tx, buf, sizeof(buf));
+		if (r < 0 && errno != EAGAIN && errno != EINTR)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Stream a counting pattern for the given time and count what arrives
+ * intact. The pattern wraps at 256 and every write starts at 0, so the
+ * check resynchronises on the write boundaries.
+ */
+static void *stream_reader(void *arg)
+{
+	struct stream_ctx *ctx = arg;
+	struct pollfd pfd = { .fd = ctx->port->rx, .events = POLLIN };
+	uint64_t start, end;
+	unsigned char buf[4096];
+	unsigned char expect = 0;
+	bool synced = false;
+	ssize_t r, i;
+
+	start = now_ns();
+	end = start + (uint64_t)ctx->seconds * 1000000000ull;
+
+	while (now_ns() < end) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		r = read(ctx->port->rx, buf, sizeof(buf));
+		if (r <= 0)
+			continue;
+
+		for (i = 0; i < r; i++) {
+			if (synced && buf[i] != expect)
+				ctx->errors++;
+			synced = true;
+			expect = buf[i] + 1;
+		}
+		ctx->bytes += r;
+	}
+
+	ctx->elapsed = now_ns() - start;
+	__atomic_store_n(&ctx->stop, true, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/* Stream on all given ports at once; returns the number of ports run. */
+static int run_streams(struct bench_port *ports, unsigned int n,
+		       unsigned int baud, unsigned int seconds,
+		       struct stream_ctx *ctx)
+{
+	pthread_t readers[BENCH_MAX_PORTS], writers[BENCH_MAX_PORTS];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (set_baud(&ports[i], baud))
+			return -1;
+		memset(&ctx[i], 0, sizeof(ctx[i]));
+		ctx[i].port = &ports[i];
+		ctx[i].seconds = seconds;
+	}
+
+	for (i = 0; i < n; i++) {
+		pthread_create(&readers[i], NULL, stream_reader, &ctx[i]);
+		pthread_create(&writers[i], NULL, stream_writer, &ctx[i]);
+	}
+
+	for (i = 0; i < n; i++) {
+		pthread_join(readers[i], NULL);
+		pthread_join(writers[i], NULL);
+		tcflush(ports[i].tx, TCIOFLUSH);
+		if (ports[i].rx != ports[i].tx)
+			tcflush(ports[i].rx, TCIOFLUSH);
+	}
+
+	return n;
+}
+
+static void bench_throughput(struct bench_port *p, const struct bench_opts *o)
+{
+	struct stream_ctx ctx;
+	unsigned int i;
+	double secs;
+
+	for (i = 0; i < o->nbauds; i++) {
+		if (run_streams(p, 1, o->bauds[i], o->seconds, &ctx) < 0)
+			continue;
+
+		secs = ctx.elapsed / 1e9;
+		/* 8N1: ten bits on the line per byte */
+		printf("{\"test\":\"throughput\",\"port\":\"%s\",\"baud\":%u,\"bytes\":%llu,\"errors\":%llu,\"seconds\":%.3f,\"bytes_per_sec\":%.0f,\"line_utilisation\":%.4f}\n",
+		       p->tx_name, o->bauds[i],
+		       (unsigned long long)ctx.bytes,
+		       (unsigned long long)ctx.errors, secs,
+		       ctx.bytes / secs, ctx.bytes * 10.0 / secs / o->bauds[i]);
+		fflush(stdout);
+	}
+}
+
+static void bench_scaling(struct bench_port *ports, unsigned int nports,
+			  const struct bench_opts *o)
+{
+	struct stream_ctx ctx[BENCH_MAX_PORTS];
+	unsigned int baud = o->bauds[o->nbauds - 1];
+	uint64_t bytes, errors;
+	unsigned int n, i;
+	double secs;
+
+	for (n = 1; n <= nports; n++) {
+		if (run_streams(ports, n, baud, o->seconds, ctx) < 0)
+			return;
+
+		bytes = errors = 0;
+		secs = 0;
+		for (i = 0; i < n; i++) {
+			bytes += ctx[i].bytes;
+			errors += ctx[i].errors;
+			if (ctx[i].elapsed / 1e9 > secs)
+				secs = ctx[i].elapsed / 1e9;
+		}
+
+		printf("{\"test\":\"scaling\",\"ports\":%u,\"baud\":%u,\"bytes\":%llu,\"errors\":%llu,\"seconds\":%.3f,\"bytes_per_sec\":%.0f,\"bytes_per_sec_per_port\":%.0f}\n",
+		       n, baud, (unsigned long long)bytes,
+		       (unsigned long long)errors, secs, bytes / secs,
+		       bytes / secs / n);
+		fflush(stdout);
+	}
+}
+
+/* Write a small frame and time until it has come back in full. */
+static void bench_latency(struct bench_port *p, const struct bench_opts *o)
+{
+	unsigned char out[BENCH_MAX_FRAME], in[BENCH_MAX_FRAME];
+	uint64_t *samples;
+	unsigned int i, j, n;
+	uint64_t t;
+
+	samples = calloc(o->iterations, sizeof(*samples));
+	if (!samples)
+		return;
+
+	for (i = 0; i < o->nbauds; i++) {
+		if (set_baud(p, o->bauds[i]))
+			continue;
+
+		for (n = 0, j = 0; j < o->iterations; j++) {
+			memset(out, j, o->frame);
+			t = now_ns();
+			if (write_full(p->tx, out, o->frame) ||
+			    read_full(p->rx, in, o->frame, o->timeout_ms))
+				break;
+			samples[n++] = now_ns() - t;
+		}
+
+		printf("{\"test\":\"round_trip\",\"port\":\"%s\",\"baud\":%u,\"frame\":%u,",
+		       p->tx_name, o->bauds[i], o->frame);
+		print_percentiles(samples, n);
+		printf("}\n");
+		fflush(stdout);
+	}
+
+	free(samples);
+}
+
+/*
+ * Time tcdrain() after a frame has been written; the ideal is the time
+ * the frame takes on the line, which is reported alongside.
+ */
+static void bench_tcdrain(struct bench_port *p, const struct bench_opts *o)
+{
+	unsigned char out[BENCH_MAX_FRAME], in[BENCH_MAX_FRAME];
+	uint64_t *samples;
+	unsigned int i, j, n;
+	uint64_t t;
+
+	samples = calloc(o->iterations, sizeof(*samples));
+	if (!samples)
+		return;
+
+	for (i = 0; i < o->nbauds; i++) {
+		if (set_baud(p, o->bauds[i]))
+			continue;
+
+		for (n = 0, j = 0; j < o->iterations; j++) {
+			memset(out, j, o->frame);
+			t = now_ns();
+			if (write_full(p->tx, out, o->frame) || tcdrain(p->tx))
+				break;
+			samples[n++] = now_ns() - t;
+			if (read_full(p->rx, in, o->frame, o->timeout_ms))
+				break;
+		}
+
+		printf("{\"test\":\"tcdrain\",\"port\":\"%s\",\"baud\":%u,\"frame\":%u,\"line_ns\":%llu,",
+		       p->tx_name, o->bauds[i], o->frame,
+		       (unsigned long long)o->frame * 10 * 1000000000ull /
+		       o->bauds[i]);
+		print_percentiles(samples, n);
+		printf("}\n");
+		fflush(stdout);
+	}
+
+	free(samples);
+}
+
+static void bench_modem(struct bench_port *p, const struct bench_opts *o)
+{
+	uint64_t *samples;
+	unsigned int j, n;
+	int lines;
+	uint64_t t;
+
+	samples = calloc(o->iterations, sizeof(*samples));
+	if (!samples)
+		return;
+
+	for (n = 0, j = 0; j < o->iterations; j++) {
+		lines = (j & 1) ? TIOCM_DTR | TIOCM_RTS : 0;
+		t = now_ns();
+		if (ioctl(p->tx, TIOCMSET, &lines))
+			break;
+		samples[n++] = now_ns() - t;
+	}
+	printf("{\"test\":\"tiocmset\",\"port\":\"%s\",", p->tx_name);
+	print_percentiles(samples, n);
+	printf("}\n");
+
+	for (n = 0, j = 0; j < o->iterations; j++) {
+		t = now_ns();
+		if (ioctl(p->tx, TIOCMGET, &lines))
+			break;
+		samples[n++] = now_ns() - t;
+	}
+	printf("{\"test\":\"tiocmget\",\"port\":\"%s\",", p->tx_name);
+	print_percentiles(samples, n);
+	printf("}\n");
+	fflush(stdout);
+
+	free(samples);
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] tx[:rx]...\n"
+		"  -b RATES   comma-separated baud rates (default 115200)\n"
+		"  -t SECS    duration of each throughput run (default 5)\n"
+		"  -n COUNT   iterations of the latency tests (default 1000)\n"
+		"  -s BYTES   frame size of the latency tests (default 8)\n"
+		"  -T TESTS   comma-separated subset of throughput, round_trip,\n"
+		"             tcdrain, modem, scaling (default all)\n",
+		prog);
+}
+
+static int parse_bauds(char *arg, struct bench_opts *o)
+{
+	char *tok;
+
+	o->nbauds = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (o->nbauds == sizeof(o->bauds) / sizeof(o->bauds[0]))
+			return -1;
+		o->bauds[o->nbauds] = strtoul(tok, NULL, 0);
+		if (!o->bauds[o->nbauds])
+			return -1;
+		o->nbauds++;
+	}
+
+	return o->nbauds ? 0 : -1;
+}
+
+static int open_port(struct bench_port *p, char *spec)
+{
+	char *sep = strchr(spec, ':');
+
+	if (sep)
+		*sep++ = '\0';
+	p->tx_name = spec;
+	p->rx_name = sep ? sep : spec;
+
+	p->tx = open(p->tx_name, O_RDWR | O_NOCTTY);
+	if (p->tx < 0) {
+		perror(p->tx_name);
+		return -1;
+	}
+
+	if (!sep) {
+		p->rx = p->tx;
+		return 0;
+	}
+
+	p->rx = open(p->rx_name, O_RDWR | O_NOCTTY);
+	if (p->rx < 0) {
+		perror(p->rx_name);
+		close(p->tx);
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool want(const char *tests, const char *name)
+{
+	size_t len = strlen(name);
+	const char *s = tests;
+
+	if (!tests)
+		return true;
+
+	while ((s = strstr(s, name))) {
+		if ((s == tests || s[-1] == ',') &&
+		    (s[len] == ',' || s[len] == '\0'))
+			return true;
+		s += len;
+	}
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o = {
+		.bauds = { 115200 },
+		.nbauds = 1,
+		.seconds = 5,
+		.iterations = 1000,
+		.frame = 8,
+		.timeout_ms = 1000,
+	};
+	struct bench_port ports[BENCH_MAX_PORTS];
+	const char *tests = NULL;
+	unsigned int nports = 0, i;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:t:n:s:T:h")) != -1) {
+		switch (c) {
+		case 'b':
+			if (parse_bauds(optarg, &o)) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 't':
+			o.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			o.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			o.frame = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			tests = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind == argc || argc - optind > BENCH_MAX_PORTS ||
+	    !o.seconds || !o.iterations || !o.frame ||
+	    o.frame > BENCH_MAX_FRAME) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	for (; optind < argc; optind++) {
+		if (open_port(&ports[nports], argv[optind]))
+			return 1;
+		nports++;
+	}
+
+	for (i = 0; i < nports; i++) {
+		if (want(tests, "throughput"))
+			bench_throughput(&ports[i], &o);
+		if (want(tests, "round_trip"))
+			bench_latency(&ports[i], &o);
+		if (want(tests, "tcdrain"))
+			bench_tcdrain(&ports[i], &o);
+		if (want(tests, "modem"))
+			bench_modem(&ports[i], &o);
+	}
+
+	if (want(tests, "scaling"))
+		bench_scaling(ports, nports, &o);
+
+	return 0;
+}
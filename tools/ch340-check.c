@@ -0,0 +1,501 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ch340-check drives a port bound to ch340-mockdev through open, termios
+ * changes, modem line changes, loopback data, streamed receive and close.
+ * It checks what reached the chip through the mock's state file, counts
+ * the control transfers each step cost, and measures receive throughput.
+ *
+ * Results are printed as TAP, with the measurements as "# key value"
+ * comments; the exit status is non-zero if any check failed, so a
+ * regression in transfer counts or throughput fails CI.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CH340_REG_DIVISOR 0x12
+#define CH340_REG_PRESCALE 0x13
+#define CH340_REG_LCR 0x18
+
+#define CH340_BIT_RTS 0x40
+#define CH340_BIT_DTR 0x20
+
+#define CHECK_SETTLE_MS 200
+#define CHECK_TIMEOUT_MS 3000
+
+struct check_opts {
+	const char *state_path;
+	const char *cmd_path;
+	long long open_max;
+	long long termios_max;
+	long long modem_max;
+	long long close_max;
+	unsigned long long stream_bytes;
+	unsigned long long paced_rate;
+	unsigned long long rx_min;
+};
+
+/* divisor settings the driver's table gives, see ch340_baud.h */
+static const struct {
+	speed_t speed;
+	unsigned int rate;
+	unsigned int factor;
+	unsigned int divisor;
+	unsigned int x2;
+} check_bauds[] = {
+	{ B9600, 9600, 78, 2, 0 },
+	{ B115200, 115200, 52, 3, 0 },
+	{ B921600, 921600, 13, 3, 1 },
+};
+
+static const struct {
+	tcflag_t cflag;
+	const char *name;
+	unsigned int lcr;
+} check_lcrs[] = {
+	{ CS8, "8N1", 0xc3 },
+	{ CS7 | PARENB, "7E1", 0xda },
+	{ CS8 | PARENB | PARODD | CSTOPB, "8O2", 0xcf },
+};
+
+static int check_num;
+static int check_failed;
+
+static void check(bool ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("%sok %d - ", ok ? "" : "not ", ++check_num);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	fflush(stdout);
+
+	if (!ok)
+		check_failed++;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+/* Look up one key in the mock's state file; -1 if it is not there. */
+static long long state_get(const struct check_opts *o, const char *key)
+{
+	char name[64];
+	long long v, r = -1;
+	FILE *f;
+
+	f = fopen(o->state_path, "r");
+	if (!f)
+		return -1;
+
+	while (fscanf(f, "%63s %lld", name, &v) == 2) {
+		if (!strcmp(name, key)) {
+			r = v;
+			break;
+		}
+	}
+
+	fclose(f);
+	return r;
+}
+
+static long long state_reg(const struct check_opts *o, unsigned int reg)
+{
+	char key[16];
+
+	snprintf(key, sizeof(key), "reg_%02x", reg);
+	return state_get(o, key);
+}
+
+/*
+ * Wait for the control traffic of the last step to finish, some of which
+ * the driver sends asynchronously, and return the request count.
+ */
+static long long settle(const struct check_opts *o)
+{
+	uint64_t end = now_ns() + CHECK_TIMEOUT_MS * 1000000ULL;
+	uint64_t quiet = 0;
+	long long last = -1, n;
+
+	while (now_ns() < end) {
+		n = state_get(o, "requests");
+		if (n != last) {
+			last = n;
+			quiet = now_ns() + CHECK_SETTLE_MS * 1000000ULL;
+		} else if (now_ns() >= quiet) {
+			break;
+		}
+		sleep_ms(20);
+	}
+
+	return last;
+}
+
+static void command(const struct check_opts *o, const char *fmt, ...)
+{
+	va_list ap;
+	FILE *f;
+
+	f = fopen(o->cmd_path, "w");
+	if (!f) {
+		perror(o->cmd_path);
+		exit(1);
+	}
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	fclose(f);
+}
+
+static int set_line(int fd, speed_t speed, tcflag_t cflag)
+{
+	struct termios t;
+
+	if (tcgetattr(fd, &t))
+		return -1;
+	cfmakeraw(&t);
+	t.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB | CRTSCTS);
+	t.c_cflag |= cflag | CLOCAL | CREAD | HUPCL;
+	t.c_cc[VMIN] = 0;
+	t.c_cc[VTIME] = 0;
+	cfsetispeed(&t, speed);
+	cfsetospeed(&t, speed);
+
+	return tcsetattr(fd, TCSANOW, &t);
+}
+
+/* Read exactly len bytes, giving up after timeout_ms without data. */
+static ssize_t read_all(int fd, uint8_t *buf, size_t len, int timeout_ms)
+{
+	struct pollfd p = { .fd = fd, .events = POLLIN };
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		n = poll(&p, 1, timeout_ms);
+		if (n <= 0)
+			break;
+		n = read(fd, buf + got, len - got);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		got += n;
+	}
+
+	return got;
+}
+
+static int wait_tiocm(int fd, int mask, int want)
+{
+	uint64_t end = now_ns() + CHECK_TIMEOUT_MS * 1000000ULL;
+	int bits = 0;
+
+	while (now_ns() < end) {
+		if (ioctl(fd, TIOCMGET, &bits))
+			return -1;
+		if ((bits & mask) == want)
+			break;
+		sleep_ms(10);
+	}
+
+	return bits;
+}
+
+static int test_open(const struct check_opts *o, const char *dev)
+{
+	long long before, n, mcr;
+	int fd;
+
+	before = settle(o);
+	fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		check(false, "open %s: %s", dev, strerror(errno));
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	n = settle(o) - before;
+
+	printf("# open_ctrl %lld\n", n);
+	check(n <= o->open_max, "open takes %lld control transfers (limit %lld)",
+	      n, o->open_max);
+
+	mcr = state_get(o, "mcr");
+	check(mcr == (CH340_BIT_DTR | CH340_BIT_RTS),
+	      "open raises DTR and RTS (mcr 0x%02llx)", mcr);
+
+	return fd;
+}
+
+static void test_termios(const struct check_opts *o, int fd)
+{
+	long long before, n, div, pre, lcr;
+	size_t i;
+
+	for (i = 0; i < sizeof(check_bauds) / sizeof(check_bauds[0]); i++) {
+		before = settle(o);
+		if (set_line(fd, check_bauds[i].speed, CS8)) {
+			check(false, "set %u baud: %s", check_bauds[i].rate,
+			      strerror(errno));
+			continue;
+		}
+		n = settle(o) - before;
+
+		printf("# termios_ctrl_%u %lld\n", check_bauds[i].rate, n);
+		check(n <= o->termios_max,
+		      "%u baud takes %lld control transfers (limit %lld)",
+		      check_bauds[i].rate, n, o->termios_max);
+
+		div = state_reg(o, CH340_REG_DIVISOR);
+		pre = state_reg(o, CH340_REG_PRESCALE);
+		check(pre == 0x100 - check_bauds[i].factor &&
+		      (div & 0x07) == (check_bauds[i].divisor |
+				       check_bauds[i].x2 << 2),
+		      "%u baud sets divisor %02llx %02llx",
+		      check_bauds[i].rate, pre, div);
+	}
+
+	/* the same settings again must not reach the chip */
+	before = settle(o);
+	set_line(fd, check_bauds[i - 1].speed, CS8);
+	n = settle(o) - before;
+	printf("# termios_ctrl_redundant %lld\n", n);
+	check(n == 0, "redundant termios change takes %lld control transfers",
+	      n);
+
+	for (i = 0; i < sizeof(check_lcrs) / sizeof(check_lcrs[0]); i++) {
+		set_line(fd, B115200, check_lcrs[i].cflag);
+		settle(o);
+		lcr = state_reg(o, CH340_REG_LCR);
+		check(lcr == check_lcrs[i].lcr, "%s sets lcr 0x%02llx",
+		      check_lcrs[i].name, lcr);
+	}
+
+	set_line(fd, B115200, CS8);
+	settle(o);
+}
+
+static void test_modem(const struct check_opts *o, int fd)
+{
+	int lines = TIOCM_DTR | TIOCM_RTS;
+	int status = TIOCM_CTS | TIOCM_DSR | TIOCM_CD;
+	long long before, n, mcr;
+	int bits;
+
+	before = settle(o);
+	ioctl(fd, TIOCMBIC, &lines);
+	n = settle(o) - before;
+	mcr = state_get(o, "mcr");
+	printf("# modem_ctrl_clear %lld\n", n);
+	check(n <= o->modem_max && mcr == 0,
+	      "clearing DTR and RTS takes %lld control transfers (limit %lld, mcr 0x%02llx)",
+	      n, o->modem_max, mcr);
+
+	bits = wait_tiocm(fd, status, 0);
+	check(bits >= 0 && !(bits & status),
+	      "CTS, DSR and DCD follow (0x%x)", bits);
+
+	before = settle(o);
+	ioctl(fd, TIOCMBIS, &lines);
+	n = settle(o) - before;
+	mcr = state_get(o, "mcr");
+	printf("# modem_ctrl_set %lld\n", n);
+	check(n <= o->modem_max && mcr == (CH340_BIT_DTR | CH340_BIT_RTS),
+	      "setting DTR and RTS takes %lld control transfers (limit %lld, mcr 0x%02llx)",
+	      n, o->modem_max, mcr);
+
+	bits = wait_tiocm(fd, status, status);
+	check(bits >= 0 && (bits & status) == status,
+	      "CTS, DSR and DCD follow (0x%x)", bits);
+}
+
+static void test_loopback(int fd)
+{
+	uint8_t out[4096], in[sizeof(out)];
+	ssize_t n;
+	size_t i;
+
+	for (i = 0; i < sizeof(out); i++)
+		out[i] = rand();
+
+	tcflush(fd, TCIOFLUSH);
+	n = write(fd, out, sizeof(out));
+	check(n == sizeof(out), "write %zu bytes (%zd)", sizeof(out), n);
+
+	n = read_all(fd, in, sizeof(in), CHECK_TIMEOUT_MS);
+	check(n == sizeof(in) && !memcmp(in, out, sizeof(in)),
+	      "loopback returns the %zu bytes written (%zd)", sizeof(out), n);
+}
+
+/* Receive a mock stream; returns the rate in bytes/s, or 0 on error. */
+static uint64_t rx_stream(const struct check_opts *o, int fd,
+			  unsigned long long bytes, unsigned long long rate)
+{
+	uint8_t buf[4096];
+	uint64_t start, ns, got = 0;
+	uint8_t pattern = 0;
+	bool good = true;
+	ssize_t n;
+	ssize_t i;
+
+	command(o, "loopback 0\n");
+	tcflush(fd, TCIFLUSH);
+
+	start = now_ns();
+	command(o, "stream %llu %llu\n", bytes, rate);
+	while (got < bytes) {
+		n = read_all(fd, buf, bytes - got < sizeof(buf) ?
+			     bytes - got : sizeof(buf), CHECK_TIMEOUT_MS);
+		if (n <= 0)
+			break;
+		for (i = 0; i < n; i++)
+			good &= buf[i] == pattern++;
+		got += n;
+	}
+	ns = now_ns() - start;
+
+	command(o, "loopback 1\n");
+
+	check(got == bytes && good, "stream of %llu bytes arrives intact (%llu)",
+	      bytes, (unsigned long long)got);
+	if (got != bytes || !ns)
+		return 0;
+
+	return got * 1000000000ULL / ns;
+}
+
+static void test_rx(const struct check_opts *o, int fd)
+{
+	uint64_t r;
+
+	/* a paced stream must keep up with the rate it is sent at */
+	r = rx_stream(o, fd, o->paced_rate, o->paced_rate);
+	printf("# rx_paced_bps %llu\n", (unsigned long long)r);
+	check(r * 100 >= o->paced_rate * 95,
+	      "paced receive at %llu bytes/s runs at %llu bytes/s",
+	      o->paced_rate, (unsigned long long)r);
+
+	r = rx_stream(o, fd, o->stream_bytes, 0);
+	printf("# rx_bps %llu\n", (unsigned long long)r);
+	check(r >= o->rx_min,
+	      "unpaced receive runs at %llu bytes/s (minimum %llu)",
+	      (unsigned long long)r, o->rx_min);
+}
+
+static void test_close(const struct check_opts *o, int fd)
+{
+	long long before, n, mcr;
+
+	before = settle(o);
+	close(fd);
+	n = settle(o) - before;
+	mcr = state_get(o, "mcr");
+
+	printf("# close_ctrl %lld\n", n);
+	check(n <= o->close_max,
+	      "close takes %lld control transfers (limit %lld)", n,
+	      o->close_max);
+	check(mcr == 0, "close drops DTR and RTS (mcr 0x%02llx)", mcr);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s -s state_file -c command_fifo [-O open_max] [-t termios_max]\n"
+		"          [-m modem_max] [-C close_max] [-n stream_bytes]\n"
+		"          [-r paced_rate] [-R rx_min] tty\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct check_opts o = {
+		.open_max = 8,
+		.termios_max = 4,
+		.modem_max = 2,
+		.close_max = 4,
+		.stream_bytes = 1 << 20,
+		.paced_rate = 11520,
+		.rx_min = 100000,
+	};
+	int fd, c;
+
+	while ((c = getopt(argc, argv, "s:c:O:t:m:C:n:r:R:")) != -1) {
+		switch (c) {
+		case 's':
+			o.state_path = optarg;
+			break;
+		case 'c':
+			o.cmd_path = optarg;
+			break;
+		case 'O':
+			o.open_max = strtoll(optarg, NULL, 0);
+			break;
+		case 't':
+			o.termios_max = strtoll(optarg, NULL, 0);
+			break;
+		case 'm':
+			o.modem_max = strtoll(optarg, NULL, 0);
+			break;
+		case 'C':
+			o.close_max = strtoll(optarg, NULL, 0);
+			break;
+		case 'n':
+			o.stream_bytes = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			o.paced_rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'R':
+			o.rx_min = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || !o.state_path || !o.cmd_path)
+		usage(argv[0]);
+
+	fd = test_open(&o, argv[optind]);
+	if (fd >= 0) {
+		test_termios(&o, fd);
+		test_modem(&o, fd);
+		test_loopback(fd);
+		test_rx(&o, fd);
+		test_close(&o, fd);
+	}
+
+	printf("1..%d\n", check_num);
+	return check_failed ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0
+#
+# Run ch340-check against a CH340 emulated by ch340-mockdev on dummy_hcd.
+# Needs root, configfs, and the dummy_hcd and libcomposite modules.
+#
+# usage: ch340-harness.sh [ch340-check options]
+#
+# CH340_KO selects the driver module to test (default ./ch340.ko).
+# Without the gadget modules or configfs the run is a TAP skip, exit 0.
+
+set -eu
+
+TOOLS=$(dirname "$0")
+KO=${CH340_KO:-./ch340.ko}
+GADGET=/sys/kernel/config/usb_gadget/ch340mock
+WORK=$(mktemp -d /tmp/ch340-harness.XXXXXX)
+FFS=$WORK/ffs
+STATE=$WORK/state
+CMD=$WORK/cmd
+MOCK_PID=
+LOADED=
+
+cleanup() {
+	set +e
+	[ -e "$GADGET/UDC" ] && echo "" > "$GADGET/UDC" 2>/dev/null
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null && wait "$MOCK_PID"
+	mountpoint -q "$FFS" && umount "$FFS"
+	if [ -d "$GADGET" ]; then
+		rm -f "$GADGET/configs/c.1/ffs.ch340"
+		rmdir "$GADGET/configs/c.1/strings/0x409" \
+		      "$GADGET/configs/c.1" \
+		      "$GADGET/functions/ffs.ch340" \
+		      "$GADGET/strings/0x409" "$GADGET" 2>/dev/null
+	fi
+	[ -n "$LOADED" ] && rmmod ch340
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+skip() {
+	echo "1..0 # SKIP $*"
+	exit 0
+}
+
+[ "$(id -u)" -eq 0 ] || skip "needs root"
+modprobe libcomposite 2>/dev/null || skip "libcomposite not available"
+modprobe dummy_hcd 2>/dev/null || skip "dummy_hcd not available"
+mountpoint -q /sys/kernel/config ||
+	mount -t configfs none /sys/kernel/config 2>/dev/null ||
+	skip "cannot mount configfs"
+[ -d /sys/kernel/config/usb_gadget ] || skip "no usb_gadget in configfs"
+ls /sys/class/udc 2>/dev/null | grep -q dummy_udc || skip "no dummy_udc"
+grep -qw functionfs /proc/filesystems ||
+	modprobe usb_f_fs 2>/dev/null || skip "functionfs not available"
+
+# the in-tree driver also matches 1a86:7523
+modprobe -r ch341 2>/dev/null || true
+if ! grep -q '^ch340 ' /proc/modules; then
+	insmod "$KO"
+	LOADED=1
+fi
+
+mkdir "$GADGET"
+echo 0x1a86 > "$GADGET/idVendor"
+echo 0x7523 > "$GADGET/idProduct"
+echo 0x0254 > "$GADGET/bcdDevice"
+# CH340s are full speed devices
+echo full-speed > "$GADGET/max_speed" 2>/dev/null || true
+mkdir "$GADGET/strings/0x409"
+echo "ch340 mock" > "$GADGET/strings/0x409/product"
+mkdir "$GADGET/configs/c.1"
+echo 100 > "$GADGET/configs/c.1/MaxPower"
+mkdir "$GADGET/functions/ffs.ch340"
+ln -s "$GADGET/functions/ffs.ch340" "$GADGET/configs/c.1/"
+
+mkdir "$FFS"
+mount -t functionfs ch340 "$FFS"
+"$TOOLS/ch340-mockdev" -s "$STATE" -c "$CMD" "$FFS" &
+MOCK_PID=$!
+
+# the endpoint files appear once the descriptors are written
+i=0
+while [ ! -e "$FFS/ep3" ]; do
+	i=$((i + 1))
+	[ $i -gt 50 ] && { echo "mock device did not start" >&2; exit 1; }
+	sleep 0.1
+done
+
+ls /sys/class/udc | grep -m1 dummy_udc > "$GADGET/UDC"
+
+# the port on the dummy bus, not any real adapter that is plugged in
+find_tty() {
+	for t in /sys/bus/usb-serial/drivers/ch340-uart/ttyUSB*; do
+		if readlink -f "$t" | grep -q dummy_hcd &&
+		   [ -c "/dev/${t##*/}" ]; then
+			echo "${t##*/}"
+			return
+		fi
+	done
+}
+
+i=0
+TTY=
+while [ -z "$TTY" ]; do
+	TTY=$(find_tty)
+	i=$((i + 1))
+	[ $i -gt 50 ] && { echo "no port bound to ch340" >&2; exit 1; }
+	if [ -z "$TTY" ]; then
+		sleep 0.1
+	fi
+done
+
+"$TOOLS/ch340-check" -s "$STATE" -c "$CMD" "$@" "/dev/$TTY"
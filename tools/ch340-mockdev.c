@@ -0,0 +1,605 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ch340-mockdev emulates a CH340 on a FunctionFS gadget function, so that
+ * the driver can be tested on dummy_hcd without hardware.
+ *
+ * It answers the vendor requests the driver sends, keeps the register
+ * file and the modem control lines, and behaves like a loopback plug:
+ * bulk-out data is echoed on bulk-in, RTS drives CTS and DTR drives DSR
+ * and DCD, with changes reported on the interrupt endpoint. On command it
+ * streams a counting pattern on bulk-in at a set rate instead.
+ *
+ * Every control request is counted, and the counts, registers and line
+ * state are written to a state file, one "key value" pair per line, each
+ * time they change. Commands are read, one per line, from a fifo:
+ *
+ *   loopback 0|1          stop or resume echoing bulk-out data
+ *   stream <bytes> <rate> send <bytes> of pattern at <rate> bytes/s
+ *                         (0 = as fast as the host takes it)
+ */
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#define CH340_REQ_READ_VERSION 0x5F
+#define CH340_REQ_WRITE_REG    0x9A
+#define CH340_REQ_READ_REG     0x95
+#define CH340_REQ_SERIAL_INIT  0xA1
+#define CH340_REQ_MODEM_CTRL   0xA4
+
+#define CH340_BIT_RTS 0x40
+#define CH340_BIT_DTR 0x20
+#define CH340_BIT_CTS 0x01
+#define CH340_BIT_DSR 0x02
+#define CH340_BIT_DCD 0x08
+
+/* the modem status register pair read by the driver */
+#define CH340_REG_STATUS 0x06
+
+#define MOCK_BULK_CHUNK 512
+
+struct mock_descs {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct {
+		struct usb_interface_descriptor intf;
+		struct usb_endpoint_descriptor_no_audio bulk_in;
+		struct usb_endpoint_descriptor_no_audio bulk_out;
+		struct usb_endpoint_descriptor_no_audio int_in;
+	} __attribute__((packed)) fs, hs;
+} __attribute__((packed));
+
+#define MOCK_STR "CH340 mock"
+
+struct mock_strings {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		char str[sizeof(MOCK_STR)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed));
+
+struct mock {
+	const char *ffs_dir;
+	const char *state_path;
+	const char *cmd_path;
+	uint8_t version;
+
+	int ep0;
+	int bulk_in;
+	int bulk_out;
+	int int_in;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t regs[256];
+	bool regs_written[256];
+	uint8_t mcr;
+	uint8_t msr;
+	bool msr_changed;
+	bool loopback;
+	uint64_t requests;
+	uint64_t req_version;
+	uint64_t req_write_reg;
+	uint64_t req_read_reg;
+	uint64_t req_serial_init;
+	uint64_t req_modem_ctrl;
+	uint64_t req_other;
+	uint64_t tx_bytes;	/* host to device */
+	uint64_t rx_bytes;	/* device to host */
+	uint64_t stream_left;
+	uint64_t stream_rate;
+	uint64_t streams_done;
+};
+
+static volatile sig_atomic_t mock_stop;
+
+static void mock_on_signal(int sig)
+{
+	(void)sig;
+	mock_stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts = {
+		.tv_sec = t / 1000000000ULL,
+		.tv_nsec = t % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR && !mock_stop)
+		;
+}
+
+/* Write the state file; called with the lock held. */
+static void mock_save(struct mock *m)
+{
+	char tmp[4096];
+	FILE *f;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", m->state_path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return;
+	}
+
+	fprintf(f, "requests %llu\n", (unsigned long long)m->requests);
+	fprintf(f, "req_read_version %llu\n",
+		(unsigned long long)m->req_version);
+	fprintf(f, "req_write_reg %llu\n",
+		(unsigned long long)m->req_write_reg);
+	fprintf(f, "req_read_reg %llu\n", (unsigned long long)m->req_read_reg);
+	fprintf(f, "req_serial_init %llu\n",
+		(unsigned long long)m->req_serial_init);
+	fprintf(f, "req_modem_ctrl %llu\n",
+		(unsigned long long)m->req_modem_ctrl);
+	fprintf(f, "req_other %llu\n", (unsigned long long)m->req_other);
+	fprintf(f, "mcr %u\n", m->mcr);
+	fprintf(f, "msr %u\n", m->msr);
+	fprintf(f, "tx_bytes %llu\n", (unsigned long long)m->tx_bytes);
+	fprintf(f, "rx_bytes %llu\n", (unsigned long long)m->rx_bytes);
+	fprintf(f, "streams_done %llu\n", (unsigned long long)m->streams_done);
+	for (i = 0; i < 256; i++) {
+		if (m->regs_written[i])
+			fprintf(f, "reg_%02x %u\n", i, m->regs[i]);
+	}
+
+	if (fclose(f) || rename(tmp, m->state_path))
+		perror(m->state_path);
+}
+
+/* A loopback plug: RTS to CTS, DTR to DSR and DCD. Lock held. */
+static void mock_update_msr(struct mock *m)
+{
+	uint8_t msr = 0;
+
+	if (m->mcr & CH340_BIT_RTS)
+		msr |= CH340_BIT_CTS;
+	if (m->mcr & CH340_BIT_DTR)
+		msr |= CH340_BIT_DSR | CH340_BIT_DCD;
+
+	if (msr != m->msr) {
+		m->msr = msr;
+		m->msr_changed = true;
+		pthread_cond_broadcast(&m->cond);
+	}
+
+	/* the chip reports the lines inverted */
+	m->regs[CH340_REG_STATUS] = ~m->msr;
+	m->regs[CH340_REG_STATUS + 1] = 0xff;
+}
+
+static void mock_stall(struct mock *m, const struct usb_ctrlrequest *setup)
+{
+	/* a data phase in the wrong direction stalls ep0 */
+	if (setup->bRequestType & USB_DIR_IN) {
+		if (read(m->ep0, NULL, 0) >= 0)
+			fprintf(stderr, "failed to stall request %02x\n",
+				setup->bRequest);
+	} else {
+		if (write(m->ep0, NULL, 0) >= 0)
+			fprintf(stderr, "failed to stall request %02x\n",
+				setup->bRequest);
+	}
+}
+
+static void mock_setup(struct mock *m, const struct usb_ctrlrequest *setup)
+{
+	uint16_t value = le16toh(setup->wValue);
+	uint16_t index = le16toh(setup->wIndex);
+	uint16_t length = le16toh(setup->wLength);
+	uint8_t buf[2] = { 0, 0 };
+	bool in = setup->bRequestType & USB_DIR_IN;
+	bool ok = true;
+
+	if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_VENDOR) {
+		mock_stall(m, setup);
+		return;
+	}
+
+	pthread_mutex_lock(&m->lock);
+	m->requests++;
+
+	switch (setup->bRequest) {
+	case CH340_REQ_READ_VERSION:
+		m->req_version++;
+		buf[0] = m->version;
+		ok = in;
+		break;
+	case CH340_REQ_READ_REG:
+		m->req_read_reg++;
+		buf[0] = m->regs[value & 0xff];
+		buf[1] = m->regs[value >> 8];
+		ok = in;
+		break;
+	case CH340_REQ_WRITE_REG:
+		m->req_write_reg++;
+		m->regs[value & 0xff] = index & 0xff;
+		m->regs[value >> 8] = index >> 8;
+		m->regs_written[value & 0xff] = true;
+		m->regs_written[value >> 8] = true;
+		ok = !in;
+		break;
+	case CH340_REQ_SERIAL_INIT:
+		m->req_serial_init++;
+		ok = !in;
+		break;
+	case CH340_REQ_MODEM_CTRL:
+		m->req_modem_ctrl++;
+		m->mcr = ~value & (CH340_BIT_DTR | CH340_BIT_RTS);
+		mock_update_msr(m);
+		ok = !in;
+		break;
+	default:
+		m->req_other++;
+		ok = false;
+		break;
+	}
+
+	mock_save(m);
+	pthread_mutex_unlock(&m->lock);
+
+	if (!ok) {
+		mock_stall(m, setup);
+		return;
+	}
+
+	if (in) {
+		if (length > sizeof(buf))
+			length = sizeof(buf);
+		if (write(m->ep0, buf, length) < 0)
+			perror("ep0 write");
+	} else if (read(m->ep0, NULL, 0) < 0) {
+		perror("ep0 ack");
+	}
+}
+
+static void *mock_bulk_out_thread(void *arg)
+{
+	struct mock *m = arg;
+	uint8_t buf[MOCK_BULK_CHUNK];
+	bool loopback;
+	ssize_t n;
+
+	while (!mock_stop) {
+		n = read(m->bulk_out, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR || errno == ESHUTDOWN)
+				continue;
+			perror("bulk out");
+			break;
+		}
+
+		pthread_mutex_lock(&m->lock);
+		m->tx_bytes += n;
+		loopback = m->loopback;
+		pthread_mutex_unlock(&m->lock);
+
+		if (loopback && n && write(m->bulk_in, buf, n) == n) {
+			pthread_mutex_lock(&m->lock);
+			m->rx_bytes += n;
+			mock_save(m);
+			pthread_mutex_unlock(&m->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* Send the requested stream, paced so no more than rate bytes/s go out. */
+static void *mock_stream_thread(void *arg)
+{
+	struct mock *m = arg;
+	uint8_t buf[MOCK_BULK_CHUNK];
+	uint64_t start, sent, left, rate;
+	uint8_t pattern;
+	size_t len, i;
+
+	for (;;) {
+		pthread_mutex_lock(&m->lock);
+		while (!m->stream_left && !mock_stop)
+			pthread_cond_wait(&m->cond, &m->lock);
+		left = m->stream_left;
+		rate = m->stream_rate;
+		pthread_mutex_unlock(&m->lock);
+		if (mock_stop)
+			break;
+
+		start = now_ns();
+		sent = 0;
+		pattern = 0;
+		while (sent < left && !mock_stop) {
+			len = left - sent < sizeof(buf) ? left - sent : sizeof(buf);
+			for (i = 0; i < len; i++)
+				buf[i] = pattern++;
+			if (rate)
+				sleep_until(start + sent * 1000000000ULL / rate);
+			if (write(m->bulk_in, buf, len) != (ssize_t)len) {
+				if (errno == EINTR)
+					continue;
+				perror("bulk in");
+				break;
+			}
+			sent += len;
+
+			pthread_mutex_lock(&m->lock);
+			m->rx_bytes += len;
+			pthread_mutex_unlock(&m->lock);
+		}
+
+		pthread_mutex_lock(&m->lock);
+		m->stream_left = 0;
+		m->streams_done++;
+		mock_save(m);
+		pthread_mutex_unlock(&m->lock);
+	}
+
+	return NULL;
+}
+
+/* Report each modem status change as the chip does, inverted. */
+static void *mock_int_thread(void *arg)
+{
+	struct mock *m = arg;
+	uint8_t pkt[4];
+
+	for (;;) {
+		pthread_mutex_lock(&m->lock);
+		while (!m->msr_changed && !mock_stop)
+			pthread_cond_wait(&m->cond, &m->lock);
+		m->msr_changed = false;
+		pkt[0] = 0;
+		pkt[1] = 0;
+		pkt[2] = ~m->msr;
+		pkt[3] = 0xff;
+		pthread_mutex_unlock(&m->lock);
+		if (mock_stop)
+			break;
+
+		if (write(m->int_in, pkt, sizeof(pkt)) < 0 && errno != EINTR &&
+		    errno != ESHUTDOWN)
+			perror("interrupt in");
+	}
+
+	return NULL;
+}
+
+static void mock_command(struct mock *m, const char *line)
+{
+	unsigned long long bytes, rate;
+	int on;
+
+	pthread_mutex_lock(&m->lock);
+	if (sscanf(line, "loopback %d", &on) == 1) {
+		m->loopback = on;
+	} else if (sscanf(line, "stream %llu %llu", &bytes, &rate) == 2) {
+		m->stream_left = bytes;
+		m->stream_rate = rate;
+		pthread_cond_broadcast(&m->cond);
+	} else {
+		fprintf(stderr, "unknown command: %s", line);
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+static void *mock_cmd_thread(void *arg)
+{
+	struct mock *m = arg;
+	char line[256];
+	FILE *f;
+
+	/* opened read-write so that it never sees end of file */
+	f = fopen(m->cmd_path, "r+");
+	if (!f) {
+		perror(m->cmd_path);
+		return NULL;
+	}
+
+	while (!mock_stop && fgets(line, sizeof(line), f))
+		mock_command(m, line);
+
+	fclose(f);
+	return NULL;
+}
+
+static void mock_fill_intf(struct mock_descs *d, bool hs)
+{
+	__typeof__(d->fs) *s = hs ? &d->hs : &d->fs;
+	uint16_t bulk = hs ? 512 : 32;
+
+	s->intf.bLength = sizeof(s->intf);
+	s->intf.bDescriptorType = USB_DT_INTERFACE;
+	s->intf.bNumEndpoints = 3;
+	s->intf.bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+	s->intf.bInterfaceSubClass = 1;
+	s->intf.bInterfaceProtocol = 2;
+	s->intf.iInterface = 1;
+
+	s->bulk_in.bLength = sizeof(s->bulk_in);
+	s->bulk_in.bDescriptorType = USB_DT_ENDPOINT;
+	s->bulk_in.bEndpointAddress = 2 | USB_DIR_IN;
+	s->bulk_in.bmAttributes = USB_ENDPOINT_XFER_BULK;
+	s->bulk_in.wMaxPacketSize = htole16(bulk);
+
+	s->bulk_out.bLength = sizeof(s->bulk_out);
+	s->bulk_out.bDescriptorType = USB_DT_ENDPOINT;
+	s->bulk_out.bEndpointAddress = 2 | USB_DIR_OUT;
+	s->bulk_out.bmAttributes = USB_ENDPOINT_XFER_BULK;
+	s->bulk_out.wMaxPacketSize = htole16(bulk);
+
+	s->int_in.bLength = sizeof(s->int_in);
+	s->int_in.bDescriptorType = USB_DT_ENDPOINT;
+	s->int_in.bEndpointAddress = 1 | USB_DIR_IN;
+	s->int_in.bmAttributes = USB_ENDPOINT_XFER_INT;
+	s->int_in.wMaxPacketSize = htole16(8);
+	s->int_in.bInterval = hs ? 4 : 1;
+}
+
+static int mock_open_ep(struct mock *m, const char *name, int flags)
+{
+	char path[4096];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", m->ffs_dir, name);
+	fd = open(path, flags);
+	if (fd < 0)
+		perror(path);
+
+	return fd;
+}
+
+static int mock_start(struct mock *m)
+{
+	struct mock_descs descs = {
+		.header = {
+			.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+			.flags = htole32(FUNCTIONFS_HAS_FS_DESC |
+					 FUNCTIONFS_HAS_HS_DESC |
+					 FUNCTIONFS_ALL_CTRL_RECIP),
+			.length = htole32(sizeof(descs)),
+		},
+		.fs_count = htole32(4),
+		.hs_count = htole32(4),
+	};
+	struct mock_strings strings = {
+		.header = {
+			.magic = htole32(FUNCTIONFS_STRINGS_MAGIC),
+			.length = htole32(sizeof(strings)),
+			.str_count = htole32(1),
+			.lang_count = htole32(1),
+		},
+		.lang0 = { htole16(0x0409), MOCK_STR },
+	};
+
+	mock_fill_intf(&descs, false);
+	mock_fill_intf(&descs, true);
+
+	m->ep0 = mock_open_ep(m, "ep0", O_RDWR);
+	if (m->ep0 < 0)
+		return -1;
+	if (write(m->ep0, &descs, sizeof(descs)) != sizeof(descs)) {
+		perror("descriptors");
+		return -1;
+	}
+	if (write(m->ep0, &strings, sizeof(strings)) != sizeof(strings)) {
+		perror("strings");
+		return -1;
+	}
+
+	/* files are numbered in descriptor order */
+	m->bulk_in = mock_open_ep(m, "ep1", O_RDWR);
+	m->bulk_out = mock_open_ep(m, "ep2", O_RDWR);
+	m->int_in = mock_open_ep(m, "ep3", O_RDWR);
+	if (m->bulk_in < 0 || m->bulk_out < 0 || m->int_in < 0)
+		return -1;
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-v version] -s state_file -c command_fifo ffs_dir\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct mock m = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.version = 0x31,
+		.loopback = true,
+	};
+	struct usb_functionfs_event events[4];
+	struct sigaction sa = { .sa_handler = mock_on_signal };
+	pthread_t threads[4];
+	ssize_t n;
+	int i, c;
+
+	while ((c = getopt(argc, argv, "v:s:c:")) != -1) {
+		switch (c) {
+		case 'v':
+			m.version = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			m.state_path = optarg;
+			break;
+		case 'c':
+			m.cmd_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || !m.state_path || !m.cmd_path)
+		usage(argv[0]);
+	m.ffs_dir = argv[optind];
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (mkfifo(m.cmd_path, 0600) && errno != EEXIST) {
+		perror(m.cmd_path);
+		return 1;
+	}
+
+	pthread_mutex_lock(&m.lock);
+	mock_update_msr(&m);
+	m.msr_changed = false;
+	mock_save(&m);
+	pthread_mutex_unlock(&m.lock);
+
+	if (mock_start(&m))
+		return 1;
+
+	pthread_create(&threads[0], NULL, mock_bulk_out_thread, &m);
+	pthread_create(&threads[1], NULL, mock_stream_thread, &m);
+	pthread_create(&threads[2], NULL, mock_int_thread, &m);
+	pthread_create(&threads[3], NULL, mock_cmd_thread, &m);
+
+	while (!mock_stop) {
+		n = read(m.ep0, events, sizeof(events));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ep0 read");
+			break;
+		}
+
+		for (i = 0; i < n / (ssize_t)sizeof(events[0]); i++) {
+			if (events[i].type == FUNCTIONFS_SETUP)
+				mock_setup(&m, &events[i].u.setup);
+		}
+	}
+
+	/* the endpoint threads are blocked in i/o; exiting ends them */
+	return 0;
+}